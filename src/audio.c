@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "audio.h"
+#include "render.h"
+#include "flac.h"
+#include "workpool.h"
+
+/* Frames rendered by a job */
+#define AUDIO_SEGMENT (16 * FLAC_BLOCK)
+
+/*
+ * The audio is cut in segments rendered by a pool of threads while the
+ * calling thread encodes and writes them in order. Each thread renders
+ * a whole segment from its position, a few segments per thread are in
+ * flight at once.
+ */
+struct segment_ {
+	long long start;
+	int frames;
+	int ready;
+	short *buf;
+};
+
+struct pipe_ {
+	const Render *render;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void render_job(void *job, void *arg)
+{
+	struct segment_ *s = job;
+	struct pipe_ *p = arg;
+
+	render_range(p->render, s->start, s->frames, s->buf);
+
+	pthread_mutex_lock(&p->lock);
+	s->ready = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static int queue_segment(WorkPool *pool, struct segment_ *s, long long index,
+                         long long frames)
+{
+	s->start = index * AUDIO_SEGMENT;
+	s->frames = frames - s->start < AUDIO_SEGMENT ?
+	            frames - s->start : AUDIO_SEGMENT;
+	s->ready = 0;
+
+	return workpool_add(pool, s);
+}
+
+static void put_le(unsigned char *p, uint32_t v, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		p[i] = v >> (8 * i);
+}
+
+static int write_wav_header(FILE *out, long long frames)
+{
+	unsigned char h[44];
+	uint32_t data = frames * 4;
+
+	memcpy(h, "RIFF", 4);
+	put_le(h + 4, 36 + data, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);
+	put_le(h + 20, 1, 2);
+	put_le(h + 22, 2, 2);
+	put_le(h + 24, AUDIO_RATE, 4);
+	put_le(h + 28, AUDIO_RATE * 4, 4);
+	put_le(h + 32, 4, 2);
+	put_le(h + 34, 16, 2);
+	memcpy(h + 36, "data", 4);
+	put_le(h + 40, data, 4);
+
+	return fwrite(h, 1, sizeof(h), out) == sizeof(h) ? 0 : -1;
+}
+
+static int write_wav(FILE *out, short *buf, int frames)
+{
+	unsigned char *p = (unsigned char *) buf;
+	int i;
+
+	/* WAV samples are little endian */
+	for (i = 0; i < 2 * frames; i++, p += 2)
+		put_le(p, (uint16_t) buf[i], 2);
+
+	return fwrite(buf, 4, frames, out) == (size_t) frames ? 0 : -1;
+}
+
+int audio_write(const char *script, const char *path, double length,
+                int jobs)
+{
+	struct pipe_ p;
+	struct segment_ *seg = NULL, *s;
+	FlacEncoder *flac = NULL;
+	WorkPool *pool;
+	Render *render;
+	FILE *out = stdout;
+	size_t len = strlen(path);
+	long long frames, count, i;
+	int slots, is_flac, write_error = 0, ret = -1;
+
+	render = render_new(script, AUDIO_RATE, length);
+	if (render == NULL)
+		return -1;
+	frames = render_frames(render);
+	count = (frames + AUDIO_SEGMENT - 1) / AUDIO_SEGMENT;
+
+	/* The sizes in a WAV header are 32 bit, about 6.7 hours of audio */
+	is_flac = len > 5 && strcasecmp(path + len - 5, ".flac") == 0;
+	if (!is_flac && frames * 4 + 36 > UINT32_MAX) {
+		fprintf(stderr, "%.0f seconds of audio do not fit in a WAV "
+		        "file, use FLAC\n", (double) frames / AUDIO_RATE);
+		goto out;
+	}
+
+	if (jobs <= 0)
+		jobs = workpool_cpus();
+	slots = 2 * jobs;
+	seg = calloc(slots, sizeof(*seg));
+	for (i = 0; seg && i < slots; i++) {
+		seg[i].buf = malloc(AUDIO_SEGMENT * 2 * sizeof(short));
+		if (seg[i].buf == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			goto out;
+		}
+	}
+	if (seg == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	if (strcmp(path, "-") != 0 && (out = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "could not open output file %s: %s\n", path,
+		        strerror(errno));
+		goto out;
+	}
+
+	/* Only failed writes are reported by the code after close */
+	write_error = 1;
+	if (is_flac) {
+		flac = flac_new(out, AUDIO_RATE, frames);
+		if (flac == NULL)
+			goto close;
+	} else if (write_wav_header(out, frames) != 0) {
+		goto close;
+	}
+	write_error = 0;
+
+	p.render = render;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	pool = workpool_new(jobs, render_job, &p);
+	if (pool == NULL) {
+		fprintf(stderr, "could not start workers\n");
+		goto destroy;
+	}
+
+	ret = 0;
+	for (i = 0; ret == 0 && i < slots && i < count; i++) {
+		if (queue_segment(pool, &seg[i], i, frames) != 0) {
+			fprintf(stderr, "Out of memory\n");
+			ret = -1;
+		}
+	}
+
+	for (i = 0; ret == 0 && i < count; i++) {
+		s = &seg[i % slots];
+		pthread_mutex_lock(&p.lock);
+		while (!s->ready)
+			pthread_cond_wait(&p.cond, &p.lock);
+		pthread_mutex_unlock(&p.lock);
+
+		if (flac)
+			ret = flac_encode(flac, s->buf, s->frames);
+		else
+			ret = write_wav(out, s->buf, s->frames);
+		if (ret != 0) {
+			write_error = 1;
+			break;
+		}
+
+		/* The slot would never become ready if it was not queued */
+		if (i + slots < count &&
+		    queue_segment(pool, s, i + slots, frames) != 0) {
+			fprintf(stderr, "Out of memory\n");
+			ret = -1;
+		}
+	}
+	workpool_free(pool);
+
+destroy:
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+close:
+	if (flac && flac_finish(flac) != 0)
+		write_error = 1;
+	if (out != stdout && fclose(out) != 0)
+		write_error = 1;
+	else if (out == stdout && fflush(out) != 0)
+		write_error = 1;
+	if (write_error) {
+		fprintf(stderr, "could not write output file %s: %s\n", path,
+		        strerror(errno));
+		ret = -1;
+	}
+out:
+	for (i = 0; seg && i < slots; i++)
+		free(seg[i].buf);
+	free(seg);
+	render_free(render);
+
+	return ret;
+}
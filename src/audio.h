@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_AUDIO_H
+#define DRG_AUDIO_H
+
+#define AUDIO_RATE 44100
+
+/*
+ * Renders sbagen data to path as 16 bit stereo audio, FLAC if the name
+ * ends in .flac and WAV otherwise, "-" writes WAV to stdout. The
+ * schedule is rendered until its last entry, or for length seconds if
+ * length is not 0, on jobs threads (0 for one per cpu).
+ *
+ * returns   0 on success, -1 on error
+ */
+int audio_write(const char *script, const char *path, double length,
+                int jobs);
+
+#endif /* DRG_AUDIO_H */
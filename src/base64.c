@@ -148,11 +148,9 @@ unsigned char *base64_decode(const char *data, size_t data_len,
 					                     0 : v - 61);
 				}
 			}
-			if (j < data_len) {
+			if (v) {
 				len++;
-				if (v) {
-					in[i] = (unsigned char) (v - 1);
-				}
+				in[i] = (unsigned char) (v - 1);
 			} else {
 				in[i] = 0;
 			}
@@ -25,43 +25,99 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #include "drgdata.h"
 #include "base64.h"
+#include "workpool.h"
+#include "shard.h"
+#include "journal.h"
+#include "hash.h"
 #include "config.h"
 
+/* Inputs of a drg file, members not given are NULL */
+struct build {
+	const char *title;
+	const char *description;
+	const char *image;
+	const char *sbagen;
+	const char *edit;
+	const char *output;
+};
 
-static void make_header(char *header)
+/*
+ * Section encoded once for the files of a batch using the same input
+ * file, the bytes are written as they are to each of them. The key of
+ * the cipher does not depend on the file, so the result is the same.
+ */
+struct shared {
+	int element;
+	const char *path;
+	int users;
+	int ready;
+	int error;
+	char *data;
+	size_t len;
+	pthread_mutex_t lock;
+};
+
+struct batch_job {
+	struct build build;
+	struct shared *shared[MAX_ELEMENTS];
+	char *line;
+	unsigned int seed;
+};
+
+struct batch {
+	Manifest *manifest;
+	Journal *journal;
+	int resume;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+/*
+ * The random state is given by the caller, so headers can be made from
+ * several threads.
+ */
+static void make_header(char *header, unsigned int *seed)
 {
-	int rnd = 0;
-	srand((unsigned int) time(NULL));
+	unsigned int rnd = 0;
 
-	rnd = (rand() + 99999) % 99999;
-	sprintf(header, "%05d", rnd);
+	rnd = (unsigned int) rand_r(seed) % 99999;
+	snprintf(header, 6, "%05u", rnd);
 }
 
-static void drg_data_add_string(DrgData *drg, int element, const char *string)
+static int drg_data_add_string(DrgData *drg, int element, const char *string)
 {
 	size_t i = 0;
-	for (i = 0; i < strlen(string); i++) {
-		drg_add_byte(drg, element, (int) string[i]);
+	int ret = DRG_OK;
+	for (i = 0; i < strlen(string) && ret == DRG_OK; i++) {
+		ret = drg_add_byte(drg, element, (int) string[i]);
 	}
+	return ret;
 }
 
-static void drg_data_add_file(DrgData *drg, int element, FILE *fd)
+static int drg_data_add_file(DrgData *drg, int element, FILE *fd)
 {
 	int c;
-	while ((c = fgetc(fd)) != EOF) {
-		drg_add_byte(drg, element, c);
+	int ret = DRG_OK;
+	while (ret == DRG_OK && (c = fgetc(fd)) != EOF) {
+		ret = drg_add_byte(drg, element, c);
 	}
+	return ret;
 }
 
-static void drg_data_add_file_b64(DrgData *drg, int element, FILE *fd)
+static int drg_data_add_file_b64(DrgData *drg, int element, FILE *fd)
 {
 	unsigned char in[3], out[4];
 	int linesize = 76;
 	int len, i, blocksout = 0;
-	while (!feof(fd)) {
+	int ret = DRG_OK;
+	while (ret == DRG_OK && !feof(fd)) {
 		len = 0;
 		for (i = 0; i < 3; i++) {
 			in[i] = (unsigned char) fgetc(fd);
@@ -73,19 +129,131 @@ static void drg_data_add_file_b64(DrgData *drg, int element, FILE *fd)
 		}
 		if (len) {
 			encodeblock(in, out, len);
-			for (i = 0; i < 4; i++) {
-				drg_add_byte(drg, element, (int) out[i]);
+			for (i = 0; i < 4 && ret == DRG_OK; i++) {
+				ret = drg_add_byte(drg, element, (int) out[i]);
 			}
 			blocksout++;
 		}
 		if (blocksout >= (linesize / 4) || feof(fd)) {
-			if (blocksout) {
-				drg_add_byte(drg, element, '\r');
-				drg_add_byte(drg, element, '\n');
+			if (blocksout && ret == DRG_OK) {
+				ret = drg_add_byte(drg, element, '\r');
+				if (ret == DRG_OK)
+					ret = drg_add_byte(drg, element, '\n');
 			}
 			blocksout = 0;
 		}
 	}
+	return ret;
+}
+
+/*
+ * Writes an element, elements kept from the edited file are copied as
+ * they are stored instead of being decoded and encoded again.
+ */
+static int dump_element(DrgData *drg, DrgData *orig, int element,
+                        FILE *fd, int linesize)
+{
+	if (orig)
+		return drg_dump_coded_to_file(orig, element, fd, linesize);
+	else
+		return drg_dump_to_file(drg, element, fd, linesize);
+}
+
+static int write_drg(DrgData *drg, DrgData **keep, struct shared **shared,
+                     FILE *out_fd)
+{
+	int element;
+	int ret;
+
+	ret = dump_element(drg, keep[HEADER], HEADER, out_fd, -1);
+	fprintf(out_fd, "\r\n");
+	for (element = TITLE; element < MAX_ELEMENTS && ret == DRG_OK;
+	     element++) {
+		if (shared && shared[element])
+			fwrite(shared[element]->data, 1,
+			       shared[element]->len, out_fd);
+		else
+			ret = dump_element(drg, keep[element], element,
+			                   out_fd, 76);
+		fprintf(out_fd, "@");
+	}
+	fprintf(out_fd, "@");
+	fprintf(out_fd, "\r\n");
+
+	if (ret == DRG_OK && ferror(out_fd))
+		ret = DRG_EIO;
+
+	return ret;
+}
+
+static FILE *open_input(const char *name)
+{
+	FILE *fd;
+
+	if (!(fd = fopen(name, "r")))
+		fprintf(stderr, "could not open file %s for reading: %s\n",
+		        name, strerror(errno));
+
+	return fd;
+}
+
+/*
+ * Encodes the shared section the first time it is needed, the other
+ * users wait for it.
+ *
+ * returns   DRG_OK or an error code
+ */
+static int shared_get(struct shared *sh)
+{
+	DrgData *drg;
+	FILE *fd, *mem;
+
+	pthread_mutex_lock(&sh->lock);
+	if (sh->ready) {
+		pthread_mutex_unlock(&sh->lock);
+		return sh->error;
+	}
+
+	sh->error = DRG_EIO;
+	drg = drg_data_new();
+	fd = open_input(sh->path);
+	mem = open_memstream(&sh->data, &sh->len);
+	if (drg == NULL || mem == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		sh->error = DRG_ENOMEM;
+	} else if (fd) {
+		if (sh->element == IMAGE)
+			sh->error = drg_data_add_file_b64(drg, IMAGE, fd);
+		else
+			sh->error = drg_data_add_file(drg, sh->element, fd);
+		if (sh->error == DRG_OK)
+			sh->error = drg_dump_to_file(drg, sh->element, mem,
+			                             76);
+	}
+	if (mem && fclose(mem) != 0 && sh->error == DRG_OK)
+		sh->error = DRG_ENOMEM;
+	if (fd)
+		fclose(fd);
+	if (drg)
+		drg_data_free(drg);
+	sh->ready = 1;
+	pthread_mutex_unlock(&sh->lock);
+
+	return sh->error;
+}
+
+/*
+ * Called by each user once done with the section, the last one frees
+ * it.
+ */
+static void shared_put(struct shared *sh)
+{
+	pthread_mutex_lock(&sh->lock);
+	if (--sh->users == 0) {
+		free(sh->data);
+		sh->data = NULL;
+	}
+	pthread_mutex_unlock(&sh->lock);
 }
 
 static void print_usage(char *prog_name)
@@ -95,6 +263,20 @@ static void print_usage(char *prog_name)
 	fprintf(stderr, "   -d file    Use description in file\n");
 	fprintf(stderr, "   -i file    Use image in file\n");
 	fprintf(stderr, "   -s file    Use sbagen data in file\n");
+	fprintf(stderr, "or, to change an existing drg file:\n");
+	fprintf(stderr, "   -e file    Edit drg file, elements not given "
+	        "are kept\n");
+	fprintf(stderr, "or, to build many drg files:\n");
+	fprintf(stderr, "   -b list    Build the files in list (name, title, "
+	        "description,\n");
+	fprintf(stderr, "              image and sbagen file separated by "
+	        "tabs)\n");
+	fprintf(stderr, "   -O dir     Output directory for batch mode\n");
+	fprintf(stderr, "   -j jobs    Number of files, or sections, built at "
+	        "once\n");
+	fprintf(stderr, "   -S K/N     Build only shard K of N of the list\n");
+	fprintf(stderr, "   -R         Resume a batch, skipping files already "
+	        "built\n");
 	fprintf(stderr, "optional options are:\n");
 	fprintf(stderr, "   -t title   Set title\n");
 	fprintf(stderr, "   -v         Print program version and exit\n");
@@ -124,16 +306,716 @@ static void print_version(void)
 	fprintf(stdout, "    GNU General Public License for more details.\n\n");
 }
 
-int main(int argc, char **argv)
+/*
+ * A section of a file built in place by write_drg_mapped(), its content
+ * comes from the first source set: a section already encoded, one kept
+ * from the edited file, a string or raw bytes of an input file.
+ */
+struct section {
+	int element;
+	struct shared *shared;
+	DrgData *keep;
+	const char *string;
+	FILE *fd;
+	size_t raw;
+	size_t len;
+	char *dst;
+	size_t size;
+	int error;
+};
+
+/*
+ * Returns the size of a regular file, other files can not be laid out
+ * before they are read.
+ */
+static int input_size(FILE *fd, size_t *size)
+{
+	struct stat st;
+
+	if (fstat(fileno(fd), &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;
+	*size = (size_t) st.st_size;
+
+	return 0;
+}
+
+/* Length of a file once encoded by drg_data_add_file_b64() */
+static size_t image_b64_size(size_t size)
+{
+	size_t blocks = (size + 2) / 3;
+
+	return blocks * 4 + 2 * ((blocks + 18) / 19);
+}
+
+/*
+ * Feeds the raw bytes of the input of s to enc, base64 encoded in lines
+ * for the image. Returns DRG_OK, or DRG_EIO if the file could not be
+ * read or its size changed since it was laid out.
+ */
+static int encode_input(DrgEncoder *enc, struct section *s)
+{
+	/* Whole lines of 57 bytes, so lines never span two reads */
+	unsigned char in[57 * 256 + 2], out[78 * 256];
+	size_t n, i, j, k, left = s->raw;
+
+	while (left > 0) {
+		n = fread(in, 1, left < 57 * 256 ? left : 57 * 256, s->fd);
+		if (n == 0)
+			return DRG_EIO;
+		left -= n;
+		if (s->element != IMAGE) {
+			drg_encoder_add(enc, in, n);
+			continue;
+		}
+		in[n] = in[n + 1] = 0;
+		for (i = 0, k = 0; i < n; i += 57) {
+			for (j = i; j < n && j < i + 57; j += 3, k += 4)
+				encodeblock(in + j, out + k,
+				            n - j < 3 ? (int) (n - j) : 3);
+			out[k++] = '\r';
+			out[k++] = '\n';
+		}
+		drg_encoder_add(enc, out, k);
+	}
+
+	return fgetc(s->fd) == EOF && !ferror(s->fd) ? DRG_OK : DRG_EIO;
+}
+
+static void section_job(void *job, void *arg)
+{
+	struct section *s = job;
+	DrgEncoder *enc;
+	size_t size;
+
+	(void) arg;
+
+	if (s->shared) {
+		memcpy(s->dst, s->shared->data, s->shared->len);
+		size = s->shared->len;
+	} else if (s->keep) {
+		size = drg_dump_coded_to_buffer(s->keep, s->element, s->dst,
+		                                s->element == HEADER ? -1 : 76);
+	} else {
+		enc = drg_encoder_new(s->dst, s->element == HEADER ? -1 : 76);
+		if (enc == NULL) {
+			s->error = DRG_ENOMEM;
+			return;
+		}
+		if (s->string)
+			drg_encoder_add(enc, s->string, s->len);
+		else if (s->fd)
+			s->error = encode_input(enc, s);
+		size = drg_encoder_finish(enc);
+	}
+
+	if (s->error == DRG_OK && size != s->size)
+		s->error = DRG_EIO;
+}
+
+/*
+ * Writes a drg file whose size is known from its sections: the file is
+ * allocated at its final size and mapped, then the sections are encoded
+ * at once by jobs threads, each straight into its place in the file.
+ *
+ * returns   DRG_OK or an error code
+ */
+static int write_drg_mapped(int fd, struct section *sec, int jobs)
+{
+	WorkPool *pool = NULL;
+	size_t total = 9, len;
+	char *map, *p;
+	int i, error = DRG_OK;
+
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		if (sec[i].shared) {
+			sec[i].size = sec[i].shared->len;
+		} else if (sec[i].keep) {
+			drg_get_coded_data(sec[i].keep, i, &len);
+			sec[i].size = drg_dump_coded_size(len,
+			                                  i == HEADER ? -1 : 76);
+		} else {
+			sec[i].size = drg_dump_size(sec[i].len,
+			                            i == HEADER ? -1 : 76);
+		}
+		total += sec[i].size;
+	}
+
+	if (posix_fallocate(fd, 0, (off_t) total) != 0)
+		return DRG_EIO;
+	map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return DRG_EIO;
+
+	/* Header, CRLF, then each section closed by @ and a final @ */
+	p = map;
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		sec[i].dst = p;
+		p += sec[i].size;
+		if (i == HEADER) {
+			*p++ = '\r';
+			*p++ = '\n';
+		} else {
+			*p++ = '@';
+		}
+	}
+	memcpy(p, "@\r\n", 3);
+
+	if (jobs != 1)
+		pool = workpool_new(jobs, section_job, NULL);
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		if (pool == NULL || workpool_add(pool, &sec[i]) != 0)
+			section_job(&sec[i], NULL);
+	}
+	if (pool)
+		workpool_free(pool);
+
+	for (i = 0; i < MAX_ELEMENTS && error == DRG_OK; i++)
+		error = sec[i].error;
+
+	if (munmap(map, total) != 0 && error == DRG_OK)
+		error = DRG_EIO;
+
+	return error;
+}
+
+/*
+ * Builds a drg file from the inputs in b, writing it to b->output or
+ * to stdout. Elements with an entry in shared (which may be NULL) are
+ * not read from their input but taken already encoded. When every input
+ * is a regular file the output is written in place by jobs threads.
+ */
+static int build_drg(const struct build *b, struct shared **shared,
+                     int jobs, unsigned int seed)
 {
 	DrgData *drg;
-	char *title = "Made with drgbuilder from drg2sbg";
-	char header[6];
+	DrgData *edit = NULL;
+	DrgData *keep[MAX_ELEMENTS] = { NULL };
+	struct section sec[MAX_ELEMENTS];
+	const char *title = b->title;
+	char header[6] = "";
 
 	FILE *dsc_fd = NULL;
 	FILE *img_fd = NULL;
 	FILE *sbg_fd = NULL;
 	FILE *out_fd = NULL;
+	FILE *edit_fd = NULL;
+
+	struct shared *none[MAX_ELEMENTS] = { NULL };
+	int ret = -1;
+	int error = DRG_OK;
+	int i, fd, mapped;
+
+	if (shared == NULL)
+		shared = none;
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		if (shared[i] && (error = shared_get(shared[i])) != DRG_OK) {
+			fprintf(stderr, "could not encode %s: %s\n",
+			        shared[i]->path, drg_strerror(error));
+			return -1;
+		}
+	}
+
+	if ((b->description && !shared[INFO] &&
+	     !(dsc_fd = open_input(b->description))) ||
+	    (b->image && !shared[IMAGE] && !(img_fd = open_input(b->image))) ||
+	    (b->sbagen && !(sbg_fd = open_input(b->sbagen))) ||
+	    (b->edit && !(edit_fd = open_input(b->edit))))
+		goto close;
+
+	drg = drg_data_new();
+	if (drg == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto close;
+	}
+
+	if (edit_fd) {
+		edit = drg_data_read(edit_fd, &error);
+		if (edit == NULL) {
+			fprintf(stderr, "could not read drg file %s: %s\n",
+			        b->edit, drg_strerror(error));
+			goto out;
+		}
+		keep[HEADER] = edit;
+		keep[TITLE] = title ? NULL : edit;
+		keep[IMAGE] = img_fd ? NULL : edit;
+		keep[INFO] = dsc_fd ? NULL : edit;
+		keep[SBG_DATA] = sbg_fd ? NULL : edit;
+	} else {
+		make_header(header, &seed);
+	}
+
+	if (title == NULL)
+		title = "Made with drgbuilder from drg2sbg";
+
+	/* Sizes of the sections, when every input is a regular file */
+	memset(sec, 0, sizeof(sec));
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		sec[i].element = i;
+		sec[i].shared = shared[i];
+		sec[i].keep = keep[i];
+	}
+	sec[HEADER].string = header;
+	sec[HEADER].len = strlen(header);
+	sec[TITLE].string = title;
+	sec[TITLE].len = strlen(title);
+	sec[IMAGE].fd = img_fd;
+	sec[INFO].fd = dsc_fd;
+	sec[SBG_DATA].fd = sbg_fd;
+	mapped = b->output != NULL;
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		if (sec[i].fd == NULL)
+			continue;
+		if (input_size(sec[i].fd, &sec[i].raw) != 0)
+			mapped = 0;
+		sec[i].len = i == IMAGE ? image_b64_size(sec[i].raw) :
+		             sec[i].raw;
+	}
+
+	if (mapped) {
+		fd = open(b->output, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			fprintf(stderr, "could not open file %s for writing: "
+			        "%s\n", b->output, strerror(errno));
+			goto out;
+		}
+		error = write_drg_mapped(fd, sec, jobs);
+		if (close(fd) != 0 && error == DRG_OK)
+			error = DRG_EIO;
+		goto written;
+	}
+
+	if (!edit)
+		error = drg_data_add_string(drg, HEADER, header);
+	if (error == DRG_OK)
+		error = drg_data_add_string(drg, TITLE, title);
+	if (error == DRG_OK && img_fd)
+		error = drg_data_add_file_b64(drg, IMAGE, img_fd);
+	if (error == DRG_OK && dsc_fd)
+		error = drg_data_add_file(drg, INFO, dsc_fd);
+	if (error == DRG_OK && sbg_fd)
+		error = drg_data_add_file(drg, SBG_DATA, sbg_fd);
+
+	if (error != DRG_OK) {
+		fprintf(stderr, "could not build drg file: %s\n",
+		        drg_strerror(error));
+		goto out;
+	}
+
+	if (b->output == NULL) {
+		out_fd = stdout;
+	} else if (!(out_fd = fopen(b->output, "w"))) {
+		fprintf(stderr, "could not open file %s for writing: %s\n",
+		        b->output, strerror(errno));
+		goto out;
+	}
+
+	error = write_drg(drg, keep, shared, out_fd);
+
+	if (out_fd != stdout && fclose(out_fd) != 0 && error == DRG_OK)
+		error = DRG_EIO;
+
+written:
+	if (error != DRG_OK) {
+		fprintf(stderr, "could not write drg file: %s\n",
+		        drg_strerror(error));
+		goto out;
+	}
+	ret = 0;
+
+out:
+	drg_data_free(drg);
+	if (edit)
+		drg_data_free(edit);
+close:
+	if (dsc_fd)
+		fclose(dsc_fd);
+	if (img_fd)
+		fclose(img_fd);
+	if (sbg_fd)
+		fclose(sbg_fd);
+	if (edit_fd)
+		fclose(edit_fd);
+
+	return ret;
+}
+
+/*
+ * Builds the drg file into a temporary file in the same directory,
+ * renamed over b->output once complete and on disk: the output, which
+ * may be the edited file, is never left half written.
+ */
+static int build_drg_file(const struct build *b, int jobs,
+                          unsigned int seed)
+{
+	struct build tmp = *b;
+	struct stat st;
+	mode_t mask;
+	char *path;
+	int fd, ret = -1;
+
+	path = malloc(strlen(b->output) + 8);
+	if (path == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	sprintf(path, "%s.XXXXXX", b->output);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "could not create file %s: %s\n", path,
+		        strerror(errno));
+		free(path);
+		return -1;
+	}
+	if (stat(b->output, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+	close(fd);
+
+	tmp.output = path;
+	if (build_drg(&tmp, NULL, jobs, seed) == 0) {
+		if (journal_sync_file(path) == 0 &&
+		    rename(path, b->output) == 0)
+			ret = 0;
+		else
+			fprintf(stderr, "could not write file %s: %s\n",
+			        b->output, strerror(errno));
+	}
+	if (ret != 0)
+		unlink(path);
+	free(path);
+
+	return ret;
+}
+
+/*
+ * The inputs of a job are identified by the title and the contents of
+ * its files.
+ */
+static int hash_inputs(const struct build *b, uint64_t *hash)
+{
+	const char *title = b->title ? b->title : "";
+
+	*hash = hash_fnv1a(title, strlen(title) + 1, HASH_INIT);
+	if (hash_file(b->description, hash, NULL) != 0 ||
+	    hash_file(b->image, hash, NULL) != 0 ||
+	    hash_file(b->sbagen, hash, NULL) != 0)
+		return -1;
+
+	return 0;
+}
+
+static void batch_job(void *job, void *arg)
+{
+	struct shard_item *item = job;
+	struct batch_job *bj = item->data;
+	struct batch *b = arg;
+	struct build tmp = bj->build;
+	const char *output = bj->build.output;
+	uint64_t in_hash, out_hash = HASH_INIT;
+	long long size = 0;
+	char *path;
+	int i, fd, ret = -1;
+
+	path = malloc(strlen(output) + 8);
+	if (path == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	if (hash_inputs(&bj->build, &in_hash) != 0) {
+		fprintf(stderr, "could not read the files of %s\n", bj->line);
+		goto out;
+	}
+
+	if (!b->resume || !journal_done(b->journal, bj->line, in_hash, output,
+	                                &size, &out_hash)) {
+		sprintf(path, "%s.XXXXXX", output);
+		fd = mkstemp(path);
+		if (fd < 0) {
+			fprintf(stderr, "could not create file %s: %s\n",
+			        path, strerror(errno));
+			goto out;
+		}
+		fchmod(fd, 0644);
+		close(fd);
+
+		tmp.output = path;
+		if (build_drg(&tmp, bj->shared, 1, bj->seed) != 0 ||
+		    journal_sync_file(path) != 0 ||
+		    rename(path, output) != 0) {
+			unlink(path);
+			goto out;
+		}
+
+		if (hash_file(output, &out_hash, &size) != 0 ||
+		    journal_add(b->journal, bj->line, in_hash, output,
+		                out_hash) != 0) {
+			fprintf(stderr, "could not record %s in the journal\n",
+			        output);
+			goto out;
+		}
+	}
+
+	if (manifest_add(b->manifest, bj->line, output, size, out_hash) == 0)
+		ret = 0;
+
+out:
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		if (bj->shared[i])
+			shared_put(bj->shared[i]);
+	}
+	free(path);
+	if (ret != 0) {
+		pthread_mutex_lock(&b->lock);
+		b->failed++;
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+struct path_ref {
+	const char *path;
+	struct batch_job *job;
+};
+
+static int compare_refs(const void *a, const void *b)
+{
+	const struct path_ref *x = a;
+	const struct path_ref *y = b;
+
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * Finds the images and descriptions used by several of the jobs, each
+ * of them is encoded once for all its jobs.
+ *
+ * returns   the shared sections, count entries at most, or NULL if out
+ *           of memory
+ */
+static struct shared *share_inputs(struct shard_item *items, int count,
+                                   int *nshared)
+{
+	static const int elements[] = { IMAGE, INFO };
+	struct path_ref *refs;
+	struct shared *shared;
+	struct batch_job *bj;
+	int e, i, j, n = 0;
+
+	refs = malloc((count + 1) * sizeof(*refs));
+	shared = calloc(count + 1, sizeof(*shared));
+	if (refs == NULL || shared == NULL) {
+		free(refs);
+		free(shared);
+		return NULL;
+	}
+
+	for (e = 0; e < 2; e++) {
+		for (i = 0; i < count; i++) {
+			bj = items[i].data;
+			refs[i].path = elements[e] == IMAGE ?
+			               bj->build.image : bj->build.description;
+			refs[i].job = bj;
+		}
+		qsort(refs, count, sizeof(*refs), compare_refs);
+
+		for (i = 0; i < count; i = j) {
+			for (j = i + 1; j < count &&
+			     strcmp(refs[i].path, refs[j].path) == 0; j++)
+				;
+			if (j - i < 2)
+				continue;
+			shared[n].element = elements[e];
+			shared[n].path = refs[i].path;
+			shared[n].users = j - i;
+			pthread_mutex_init(&shared[n].lock, NULL);
+			for (; i < j; i++)
+				refs[i].job->shared[elements[e]] = &shared[n];
+			n++;
+		}
+	}
+
+	free(refs);
+	*nshared = n;
+
+	return shared;
+}
+
+static long long file_size(const char *name)
+{
+	struct stat st;
+	return (name && stat(name, &st) == 0) ? (long long) st.st_size : 0;
+}
+
+/*
+ * Builds the drg files listed in list_name, one per line with the
+ * fields name, title, description, image and sbagen file separated by
+ * tabs. The files are written to out_dir, with a shard only its part
+ * of the list is built.
+ */
+static int run_batch(const char *list_name, const char *out_dir, int jobs,
+                     const char *shard, int resume, unsigned int seed)
+{
+	FILE *list;
+	struct shard_item *items = NULL;
+	struct batch_job *bjobs = NULL;
+	struct shared *shared = NULL;
+	struct batch b;
+	WorkPool *pool;
+	char line[4096];
+	char *field[5], *p;
+	int i, f, k = 1, n = 1;
+	int count = 0, alloc = 0, selected, nshared = 0, ret = -1;
+
+	if (shard && shard_parse(shard, &k, &n) != 0) {
+		fprintf(stderr, "invalid shard %s, must be K/N\n", shard);
+		return -1;
+	}
+
+	if (!(list = open_input(list_name)))
+		return -1;
+
+	while (fgets(line, sizeof(line), list)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		for (p = line, f = 0; f < 5 && p; f++) {
+			field[f] = p;
+			p = strchr(p, '\t');
+			if (p)
+				*p++ = '\0';
+		}
+		if (f < 5 || field[0][0] == '\0') {
+			fprintf(stderr, "invalid line in %s: %s\n", list_name,
+			        field[0]);
+			goto out;
+		}
+
+		if (count == alloc) {
+			struct batch_job *tmp;
+			alloc = alloc * 2 + 64;
+			tmp = realloc(bjobs, alloc * sizeof(*bjobs));
+			if (tmp == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				goto out;
+			}
+			bjobs = tmp;
+		}
+		memset(&bjobs[count], 0, sizeof(*bjobs));
+		bjobs[count].line = strdup(field[0]);
+		bjobs[count].build.title = field[1][0] ? strdup(field[1]) : NULL;
+		bjobs[count].build.description = strdup(field[2]);
+		bjobs[count].build.image = strdup(field[3]);
+		bjobs[count].build.sbagen = strdup(field[4]);
+		p = malloc(strlen(out_dir) + strlen(field[0]) + 2);
+		if (p)
+			sprintf(p, "%s/%s", out_dir, field[0]);
+		bjobs[count].build.output = p;
+		bjobs[count].seed = seed + (unsigned int) count;
+		count++;
+	}
+
+	items = calloc(count + 1, sizeof(*items));
+	if (items == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		if (!bjobs[i].line || !bjobs[i].build.description ||
+		    !bjobs[i].build.image || !bjobs[i].build.sbagen ||
+		    !bjobs[i].build.output) {
+			fprintf(stderr, "Out of memory\n");
+			goto out;
+		}
+		items[i].key = bjobs[i].line;
+		items[i].size = file_size(bjobs[i].build.description) +
+		                file_size(bjobs[i].build.image) +
+		                file_size(bjobs[i].build.sbagen);
+		items[i].data = &bjobs[i];
+	}
+
+	selected = shard_select(items, count, k, n);
+	if (selected < 0 ||
+	    (shared = share_inputs(items, selected, &nshared)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	p = malloc(strlen(out_dir) + 40);
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	sprintf(p, "%s/journal-%d-of-%d", out_dir, k, n);
+	b.journal = journal_open(p, resume);
+	free(p);
+	if (b.journal == NULL)
+		goto out;
+
+	b.failed = 0;
+	b.resume = resume;
+	pthread_mutex_init(&b.lock, NULL);
+	b.manifest = manifest_new(out_dir, k, n);
+	pool = b.manifest ? workpool_new(jobs, batch_job, &b) : NULL;
+	if (pool == NULL) {
+		fprintf(stderr, "could not start workers\n");
+		if (b.manifest)
+			manifest_close(b.manifest);
+		journal_close(b.journal);
+		pthread_mutex_destroy(&b.lock);
+		goto out;
+	}
+	for (i = 0; i < selected; i++) {
+		if (workpool_add(pool, &items[i]) == 0)
+			continue;
+		fprintf(stderr, "could not build %s: Out of memory\n",
+		        items[i].key);
+		pthread_mutex_lock(&b.lock);
+		b.failed++;
+		pthread_mutex_unlock(&b.lock);
+	}
+	workpool_free(pool);
+
+	if (manifest_close(b.manifest) != 0)
+		b.failed++;
+	journal_close(b.journal);
+	pthread_mutex_destroy(&b.lock);
+	ret = b.failed ? -1 : 0;
+
+out:
+	for (i = 0; i < nshared; i++) {
+		free(shared[i].data);
+		pthread_mutex_destroy(&shared[i].lock);
+	}
+	free(shared);
+	for (i = 0; i < count; i++) {
+		free(bjobs[i].line);
+		free((char *) bjobs[i].build.title);
+		free((char *) bjobs[i].build.description);
+		free((char *) bjobs[i].build.image);
+		free((char *) bjobs[i].build.sbagen);
+		free((char *) bjobs[i].build.output);
+	}
+	free(bjobs);
+	free(items);
+	fclose(list);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct build b;
+	char *batch = NULL;
+	char *out_dir = NULL;
+	char *shard = NULL;
+	int jobs = 0;
+	int resume = 0;
+	int ret;
+	unsigned int seed = (unsigned int) time(NULL);
 
 	int opt;
 	int option_index;
@@ -144,48 +1026,54 @@ int main(int argc, char **argv)
 		{"image", 1, 0, 'i'},
 		{"sbagen", 1, 0, 's'},
 		{"output", 1, 0, 'o'},
+		{"edit", 1, 0, 'e'},
+		{"batch", 1, 0, 'b'},
+		{"out", 1, 0, 'O'},
+		{"jobs", 1, 0, 'j'},
+		{"shard", 1, 0, 'S'},
+		{"resume", 0, 0, 'R'},
 		{"version", 0, 0, 'v'},
 		{"help", 0, 0, 'h'},
 		{0,0,0,0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "t:d:i:s:o:vh",
+	memset(&b, 0, sizeof(b));
+
+	while ((opt = getopt_long(argc, argv, "t:d:i:s:o:e:b:O:j:S:Rvh",
 	                          long_option, &option_index)) != -1) {
 		switch (opt) {
 		case 't':
-			title = optarg;
+			b.title = optarg;
 			break;
 		case 'd':
-			if (!(dsc_fd = fopen(optarg, "r"))) {
-				fprintf(stderr, "could not open file %s "
-				        "for reading: %s\n", optarg,
-				        strerror(errno));
-				return EXIT_FAILURE;
-			}
+			b.description = optarg;
 			break;
 		case 'i':
-			if (!(img_fd = fopen(optarg, "r"))) {
-				fprintf(stderr, "could not open file %s "
-				        "for reading: %s\n", optarg,
-				        strerror(errno));
-				return EXIT_FAILURE;
-			}
+			b.image = optarg;
 			break;
 		case 's':
-			if (!(sbg_fd = fopen(optarg, "r"))) {
-				fprintf(stderr, "could not open file %s "
-				        "for reading: %s\n", optarg,
-				        strerror(errno));
-				return EXIT_FAILURE;
-			}
+			b.sbagen = optarg;
 			break;
 		case 'o':
-			if (!(out_fd = fopen(optarg, "w"))) {
-				fprintf(stderr, "could not open file %s "
-				        "for writing: %s\n", optarg,
-				        strerror(errno));
-				return EXIT_FAILURE;
-			}
+			b.output = optarg;
+			break;
+		case 'e':
+			b.edit = optarg;
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'O':
+			out_dir = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'S':
+			shard = optarg;
+			break;
+		case 'R':
+			resume = 1;
 			break;
 		case 'v':
 			print_version();
@@ -200,43 +1088,27 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (out_fd == NULL)
-		out_fd = stdout;
-
-	if (dsc_fd == NULL || img_fd == NULL || sbg_fd == NULL) {
-		print_usage(argv[0]);
-		return EXIT_FAILURE;
+	if (batch) {
+		if (out_dir == NULL) {
+			fprintf(stderr, "--batch needs an output directory "
+			        "(-O)\n");
+			return EXIT_FAILURE;
+		}
+		if (run_batch(batch, out_dir, jobs, shard, resume, seed) != 0)
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
 	}
 
-	drg = drg_data_new();
-	if (drg == NULL) {
-		fprintf(stderr, "Out of memory\n");
+	if (b.edit == NULL &&
+	    (b.description == NULL || b.image == NULL || b.sbagen == NULL)) {
+		print_usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	make_header(header);
-	drg_data_add_string(drg, HEADER, header);
-	drg_data_add_string(drg, TITLE, title);
-	drg_data_add_file_b64(drg, IMAGE, img_fd);
-	drg_data_add_file(drg, INFO, dsc_fd);
-	drg_data_add_file(drg, SBG_DATA, sbg_fd);
-
-	drg_dump_to_file(drg, HEADER, out_fd, -1);
-	fprintf(out_fd, "\r\n");
-	drg_dump_to_file(drg, TITLE, out_fd, 76);
-	fprintf(out_fd, "@");
-	drg_dump_to_file(drg, IMAGE, out_fd, 76);
-	fprintf(out_fd, "@");
-	drg_dump_to_file(drg, INFO, out_fd, 76);
-	fprintf(out_fd, "@");
-	drg_dump_to_file(drg, SBG_DATA, out_fd, 76);
-	fprintf(out_fd, "@@");
-	fprintf(out_fd, "\r\n");
-
-	if (out_fd != stdout)
-		fclose(out_fd);
-
-	drg_data_free(drg);
+	if (b.output)
+		ret = build_drg_file(&b, jobs, seed);
+	else
+		ret = build_drg(&b, NULL, jobs, seed);
 
-	return EXIT_SUCCESS;
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
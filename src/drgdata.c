@@ -27,13 +27,109 @@
 #include "drgdata.h"
 #include "base64.h"
 
+/* Initial state of the cipher, the key is the same for every file */
+static const unsigned char cipher_key[256] = {
+	22,  213, 140,  67, 234,  48, 108, 225,   6, 101, 194,  50,  44,
+	247,  58, 145,  20,  80, 241,  60, 127, 154, 125,  33,  45, 166,
+	245,  84,  28, 110, 220,  56, 195, 181, 238, 109,  69, 216,  31,
+	162,  61, 183,  74,  71, 129, 148, 170, 111, 137, 164, 179, 178,
+	9,    41, 160, 219,  77,  93,  97, 143,  14, 158, 118, 152,   0,
+	221, 192, 116,  86,  65,  55, 173, 217,  32, 227, 119, 102, 115,
+	254, 132,  95,  23,  49,  73, 211, 142,  66,  59,  85, 252, 138,
+	212, 243,  38, 134, 165, 184,  13, 209, 124, 197, 141, 114,  43,
+	92,  133, 175, 205, 128,  68,  91, 104,  64, 126,  39,  40,  46,
+	72,  139, 232, 182,   2, 131, 201, 188, 112, 200,  78, 159, 113,
+	237,  99, 249,  90,   7,  47, 122,  36,  76, 117, 222, 149,  96,
+	82,  100, 208, 151, 198, 228,  94,  87, 190,  42, 246,  10, 169,
+	171, 120,  51, 236, 255, 215, 191, 223,  54, 103,  89, 135,  57,
+	98,  176, 161,  24, 235,  26,   3, 250, 233, 121,  79, 207, 242,
+	224,  11, 123, 193, 155, 157, 218, 186, 244,  75, 167,  63, 206,
+	81,   29, 150, 229,   4,  15, 230,  37, 185,   1, 203,  35,  16,
+	136, 204, 144, 253, 214, 168,  27, 189, 105, 231, 177,  18,  25,
+	52,   70,  88, 196, 210, 163, 239, 156,  19,  34,  17, 202,  30,
+	21,   62, 147, 174, 240, 130,   8, 180, 106, 172,  83,  12, 146,
+	251, 226,  53, 153, 107, 199, 248, 187,   5
+};
+
+struct cipher_ {
+	unsigned char S[256];
+	int i;
+	int j;
+};
+
 struct drgdata_ {
 	unsigned char *data[MAX_ELEMENTS];
 	size_t len[MAX_ELEMENTS];
 	size_t alloc[MAX_ELEMENTS];
+	int sections;
+	int complete;
+	int error;
+	drg_trace_fn trace;
+	void *trace_arg;
+	unsigned char *keystream;
+	size_t keystream_len;
+	size_t keystream_alloc;
+	struct cipher_ keystream_c;
 };
 
-static const char *element_to_text(int element)
+static void cipher_init(struct cipher_ *c)
+{
+	memcpy(c->S, cipher_key, sizeof(c->S));
+	c->i = 0;
+	c->j = 0;
+}
+
+static unsigned char cipher_next(struct cipher_ *c)
+{
+	unsigned char temp;
+
+	c->i = (c->i + 1) % 256;
+	c->j = (c->j + c->S[c->i]) % 256;
+	temp = c->S[c->i];
+	c->S[c->i] = c->S[c->j];
+	c->S[c->j] = temp;
+
+	return c->S[(c->S[c->i] + c->S[c->j]) % 256];
+}
+
+/*
+ * Deciphers len bytes of src starting at offset of the keystream into
+ * dst. The keystream does not depend on the data, its bytes are kept in
+ * drg as far as the largest offset read so far, with the state of the
+ * cipher to extend them.
+ *
+ * returns   0 on success, -1 if out of memory
+ */
+static int keystream_xor(DrgData *drg, unsigned char *dst,
+                         const unsigned char *src, size_t offset, size_t len)
+{
+	size_t end = offset + len, a;
+
+	if (end > drg->keystream_alloc) {
+		unsigned char *new;
+
+		for (a = drg->keystream_alloc ? drg->keystream_alloc : 4096;
+		     a < end; a *= 2)
+			;
+		new = realloc(drg->keystream, a);
+		if (new == NULL)
+			return -1;
+		drg->keystream = new;
+		drg->keystream_alloc = a;
+	}
+	if (drg->keystream_len == 0)
+		cipher_init(&drg->keystream_c);
+	for (; drg->keystream_len < end; drg->keystream_len++)
+		drg->keystream[drg->keystream_len] =
+			cipher_next(&drg->keystream_c);
+
+	for (a = 0; a < len; a++)
+		dst[a] = src[a] ^ drg->keystream[offset + a];
+
+	return 0;
+}
+
+const char *drg_element_name(int element)
 {
 	char *str;
 
@@ -61,16 +157,78 @@ static const char *element_to_text(int element)
 	return str;
 }
 
+const char *drg_strerror(int error)
+{
+	switch (error) {
+	case DRG_OK:
+		return "success";
+	case DRG_ENOMEM:
+		return "out of memory";
+	case DRG_EELEMENT:
+		return "unknown element";
+	case DRG_EDECODE:
+		return "could not decode data";
+	case DRG_EIO:
+		return "input/output error";
+	default:
+		return "unknown error";
+	}
+}
+
+int drg_section_count(DrgData *drg, int *complete)
+{
+	if (complete)
+		*complete = drg->complete;
+
+	return drg->sections;
+}
+
+const char *drg_stage_name(int stage)
+{
+	switch (stage) {
+	case DRG_STAGE_BASE64:
+		return "base64";
+	case DRG_STAGE_CIPHER:
+		return "cipher";
+	case DRG_STAGE_IMAGE:
+		return "image";
+	default:
+		return "unknown";
+	}
+}
+
+void drg_set_trace(DrgData *drg, drg_trace_fn fn, void *arg)
+{
+	drg->trace = fn;
+	drg->trace_arg = arg;
+}
+
+static void trace(DrgData *drg, int stage, int begin, size_t size)
+{
+	if (drg->trace)
+		drg->trace(stage, begin, size, drg->trace_arg);
+}
+
+int drg_error(DrgData *drg)
+{
+	assert(drg != NULL);
+	return drg->error;
+}
+
 DrgData *drg_data_new(void)
 {
 	int i;
 	DrgData *drg;
-	drg = malloc(sizeof(*drg));
+	drg = calloc(1, sizeof(*drg));
 	if (drg == NULL)
 		return NULL;
 
 	for (i = 0; i < MAX_ELEMENTS; i++) {
 		drg->data[i] = malloc(1024);
+		if (drg->data[i] == NULL) {
+			drg_data_free(drg);
+			return NULL;
+		}
 		drg->len[i] = 0;
 		drg->alloc[i] = 1024;
 	}
@@ -84,69 +242,105 @@ void drg_data_free(DrgData *drg)
 	for (i = 0; i < MAX_ELEMENTS; i++) {
 		free(drg->data[i]);
 	}
+	free(drg->keystream);
 	free(drg);
 }
 
-void drg_add_byte(DrgData *drg, int element, int byte)
+DrgData *drg_data_read(FILE *fd, int *error)
+{
+	DrgData *drg;
+	int c, i = HEADER;
+	int ret = DRG_OK;
+	int closed = 0, empty = 1, prev_empty = 0;
+
+	drg = drg_data_new();
+	if (drg == NULL) {
+		if (error)
+			*error = DRG_ENOMEM;
+		return NULL;
+	}
+
+	/* The header is a special element, not separated by @ */
+	while (ret == DRG_OK && (c = fgetc(fd)) != EOF) {
+		if (c == '\n' || c == '\r' || c == '@')
+			break;
+		else
+			ret = drg_add_byte(drg, i, c);
+	}
+
+	i = TITLE;
+	/* Rest of elements separated by @ */
+	while (ret == DRG_OK && (c = fgetc(fd)) != EOF) {
+		if (c == '@') {
+			i++;
+			closed++;
+			prev_empty = empty;
+			empty = 1;
+		} else if (c != '\n' && c != '\r') {
+			empty = 0;
+			if (i < MAX_ELEMENTS)
+				ret = drg_add_byte(drg, i, c);
+		}
+	}
+
+	/* The file ends with an empty section closed by @ */
+	drg->complete = closed > 0 && prev_empty && empty;
+	drg->sections = (drg->len[HEADER] > 0) + closed -
+	                drg->complete + !empty;
+
+	if (ret == DRG_OK && ferror(fd))
+		ret = DRG_EIO;
+
+	if (error)
+		*error = ret;
+	if (ret != DRG_OK) {
+		drg_data_free(drg);
+		return NULL;
+	}
+
+	return drg;
+}
+
+int drg_add_byte(DrgData *drg, int element, int byte)
 {
 	assert(drg != NULL);
 	if (element >= MAX_ELEMENTS)
-		return;
+		return drg->error = DRG_EELEMENT;
 
-	if (drg->len[element] < drg->alloc[element]) {
-		drg->data[element][drg->len[element]] = (unsigned char)byte;
-		drg->len[element]++;
-	} else {
+	if (drg->len[element] >= drg->alloc[element]) {
 		unsigned char *new;
-		drg->alloc[element]+=1024;
-		new = realloc(drg->data[element], drg->alloc[element]);
+		new = realloc(drg->data[element], drg->alloc[element] * 2);
+		if (new == NULL)
+			return drg->error = DRG_ENOMEM;
 		drg->data[element] = new;
-		drg->data[element][drg->len[element]] = (unsigned char)byte;
-		drg->len[element]++;
+		drg->alloc[element] *= 2;
 	}
+
+	drg->data[element][drg->len[element]] = (unsigned char)byte;
+	drg->len[element]++;
+
+	return DRG_OK;
 }
 
 unsigned char *drg_get_uncoded_data(DrgData *drg, int element, size_t *len)
 {
 	unsigned char *data;
-	unsigned char temp;
-	int i = 0, j = 0;
+	struct cipher_ c;
 	size_t a = 0, b = 0;
 
-	unsigned char S[] = {
-		22,  213, 140,  67, 234,  48, 108, 225,   6, 101, 194,  50,  44,
-		247,  58, 145,  20,  80, 241,  60, 127, 154, 125,  33,  45, 166,
-		245,  84,  28, 110, 220,  56, 195, 181, 238, 109,  69, 216,  31,
-		162,  61, 183,  74,  71, 129, 148, 170, 111, 137, 164, 179, 178,
-		9,    41, 160, 219,  77,  93,  97, 143,  14, 158, 118, 152,   0,
-		221, 192, 116,  86,  65,  55, 173, 217,  32, 227, 119, 102, 115,
-		254, 132,  95,  23,  49,  73, 211, 142,  66,  59,  85, 252, 138,
-		212, 243,  38, 134, 165, 184,  13, 209, 124, 197, 141, 114,  43,
-		92,  133, 175, 205, 128,  68,  91, 104,  64, 126,  39,  40,  46,
-		72,  139, 232, 182,   2, 131, 201, 188, 112, 200,  78, 159, 113,
-		237,  99, 249,  90,   7,  47, 122,  36,  76, 117, 222, 149,  96,
-		82,  100, 208, 151, 198, 228,  94,  87, 190,  42, 246,  10, 169,
-		171, 120,  51, 236, 255, 215, 191, 223,  54, 103,  89, 135,  57,
-		98,  176, 161,  24, 235,  26,   3, 250, 233, 121,  79, 207, 242,
-		224,  11, 123, 193, 155, 157, 218, 186, 244,  75, 167,  63, 206,
-		81,   29, 150, 229,   4,  15, 230,  37, 185,   1, 203,  35,  16,
-		136, 204, 144, 253, 214, 168,  27, 189, 105, 231, 177,  18,  25,
-		52,   70,  88, 196, 210, 163, 239, 156,  19,  34,  17, 202,  30,
-		21,   62, 147, 174, 240, 130,   8, 180, 106, 172,  83,  12, 146,
-		251, 226,  53, 153, 107, 199, 248, 187,   5
-	};
 
 	if (element >= MAX_ELEMENTS) {
-		fprintf(stderr, "ERROR: could not convert %s\n",
-		        element_to_text(element));
+		drg->error = DRG_EELEMENT;
 		return NULL;
 	}
 
+	trace(drg, DRG_STAGE_BASE64, 1, drg->len[element]);
 	data = base64_decode((char *)drg->data[element], drg->len[element], &a);
+	trace(drg, DRG_STAGE_BASE64, 0, a);
 
 	if (a < 1) {
-		fprintf(stderr, "ERROR: could not convert %s\n",
-		        element_to_text(element));
+		drg->error = (data || drg->len[element] == 0) ?
+		             DRG_EDECODE : DRG_ENOMEM;
 		if (data)
 			free(data);
 		return NULL;
@@ -155,30 +349,29 @@ unsigned char *drg_get_uncoded_data(DrgData *drg, int element, size_t *len)
 	if (len)
 		*len = a;
 
-	for (b = 0; b < a; b++) {
-		i = (i +1) % 256;
-		j = (j + S[i]) % 256;
-		temp = S[i];
-		S[i] = S[j];
-		S[j] = temp;
-		data[b] = data[b] ^ (S[(S[i] + S[j]) % 256]);
-	}
+	trace(drg, DRG_STAGE_CIPHER, 1, a);
+	cipher_init(&c);
+	for (b = 0; b < a; b++)
+		data[b] = data[b] ^ cipher_next(&c);
+	trace(drg, DRG_STAGE_CIPHER, 0, a);
 
 	if (element == IMAGE) {
 		unsigned char *img_data = NULL;
 		size_t img_len = 0;
 
+		trace(drg, DRG_STAGE_IMAGE, 1, a);
 		img_data = base64_decode((char *)data, a, &img_len);
+		trace(drg, DRG_STAGE_IMAGE, 0, img_len);
 		if (img_len < 1) {
-			fprintf(stderr, "ERROR: could not convert %s\n",
-			        element_to_text(element));
+			drg->error = img_data ? DRG_EDECODE : DRG_ENOMEM;
 			free(data);
 			free(img_data);
 			return NULL;
 		} else {
 			free(data);
 			data = img_data;
-			*len = img_len;
+			if (len)
+				*len = img_len;
 		}
 	} else {
 		data[a] = '\0';
@@ -187,57 +380,214 @@ unsigned char *drg_get_uncoded_data(DrgData *drg, int element, size_t *len)
 	return data;
 }
 
-void drg_dump_to_file(DrgData *drg, int element, FILE *fd, int linesize)
+const unsigned char *drg_get_coded_data(DrgData *drg, int element,
+                                        size_t *len)
 {
-	char *data;
-	unsigned char temp;
-	int i = 0, j = 0;
-	size_t a = 0, b = 0;
+	assert(drg != NULL);
+	if (element >= MAX_ELEMENTS) {
+		drg->error = DRG_EELEMENT;
+		return NULL;
+	}
 
-	unsigned char S[] = {
-		22,  213, 140,  67, 234,  48, 108, 225,   6, 101, 194,  50,  44,
-		247,  58, 145,  20,  80, 241,  60, 127, 154, 125,  33,  45, 166,
-		245,  84,  28, 110, 220,  56, 195, 181, 238, 109,  69, 216,  31,
-		162,  61, 183,  74,  71, 129, 148, 170, 111, 137, 164, 179, 178,
-		9,    41, 160, 219,  77,  93,  97, 143,  14, 158, 118, 152,   0,
-		221, 192, 116,  86,  65,  55, 173, 217,  32, 227, 119, 102, 115,
-		254, 132,  95,  23,  49,  73, 211, 142,  66,  59,  85, 252, 138,
-		212, 243,  38, 134, 165, 184,  13, 209, 124, 197, 141, 114,  43,
-		92,  133, 175, 205, 128,  68,  91, 104,  64, 126,  39,  40,  46,
-		72,  139, 232, 182,   2, 131, 201, 188, 112, 200,  78, 159, 113,
-		237,  99, 249,  90,   7,  47, 122,  36,  76, 117, 222, 149,  96,
-		82,  100, 208, 151, 198, 228,  94,  87, 190,  42, 246,  10, 169,
-		171, 120,  51, 236, 255, 215, 191, 223,  54, 103,  89, 135,  57,
-		98,  176, 161,  24, 235,  26,   3, 250, 233, 121,  79, 207, 242,
-		224,  11, 123, 193, 155, 157, 218, 186, 244,  75, 167,  63, 206,
-		81,   29, 150, 229,   4,  15, 230,  37, 185,   1, 203,  35,  16,
-		136, 204, 144, 253, 214, 168,  27, 189, 105, 231, 177,  18,  25,
-		52,   70,  88, 196, 210, 163, 239, 156,  19,  34,  17, 202,  30,
-		21,   62, 147, 174, 240, 130,   8, 180, 106, 172,  83,  12, 146,
-		251, 226,  53, 153, 107, 199, 248, 187,   5
-	};
+	if (len)
+		*len = drg->len[element];
 
-	if (element >= MAX_ELEMENTS) {
-		fprintf(stderr, "ERROR: could not convert %s\n",
-		        element_to_text(element));
-		return;
+	return drg->data[element];
+}
+
+static int is_base64(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+	       (c >= '0' && c <= '9') || c == '+' || c == '/' || c == '=';
+}
+
+/*
+ * Decodes a range by decoding the whole element, used when the layout
+ * of the element does not allow to locate the range directly.
+ */
+static ssize_t read_range_full(DrgData *drg, int element, size_t offset,
+                               size_t len, unsigned char *dst)
+{
+	unsigned char *data;
+	size_t a = 0;
+
+	data = drg_get_uncoded_data(drg, element, &a);
+	if (data == NULL)
+		return -1;
+
+	if (offset >= a)
+		len = 0;
+	else if (len > a - offset)
+		len = a - offset;
+	memcpy(dst, data + offset, len);
+	free(data);
+
+	return (ssize_t) len;
+}
+
+/*
+ * Decodes a range of the ciphered data, every 3 bytes are stored in 4
+ * base64 characters so only the blocks covering the range are decoded
+ * and deciphered with the keystream kept in drg.
+ */
+static ssize_t read_range_coded(DrgData *drg, int element, size_t offset,
+                                size_t len, unsigned char *dst)
+{
+	const unsigned char *coded = drg->data[element];
+	unsigned char *data;
+	size_t clen = drg->len[element];
+	size_t first, last, a = 0, b;
+
+	while (clen > 0 && coded[clen - 1] == '=')
+		clen--;
+
+	if (len == 0 || offset >= clen * 3 / 4)
+		return 0;
+	if (len > clen * 3 / 4 - offset)
+		len = clen * 3 / 4 - offset;
+
+	first = (offset / 3) * 4;
+	last = ((offset + len + 2) / 3) * 4;
+	if (last > clen)
+		last = clen;
+
+	for (b = first; b < last; b++) {
+		if (!is_base64(coded[b]))
+			return read_range_full(drg, element, offset, len, dst);
 	}
 
-	a = drg->len[element];
-	for (b = 0; b < a; b++) {
-		i = (i +1) % 256;
-		j = (j + S[i]) % 256;
-		temp = S[i];
-		S[i] = S[j];
-		S[j] = temp;
-		drg->data[element][b] = drg->data[element][b] ^
-		                        (S[(S[i] + S[j]) % 256]);
+	data = base64_decode((const char *) coded + first, last - first, &a);
+	if (data == NULL) {
+		drg->error = DRG_ENOMEM;
+		return -1;
+	}
+
+	b = offset - (first / 4) * 3;
+	if (a <= b)
+		len = 0;
+	else if (len > a - b)
+		len = a - b;
+	if (keystream_xor(drg, dst, data + b, offset, len) != 0) {
+		free(data);
+		drg->error = DRG_ENOMEM;
+		return -1;
+	}
+	free(data);
+
+	return (ssize_t) len;
+}
+
+/*
+ * The image is base64 encoded again before the cipher, in lines of a
+ * fixed width. The width is taken from the first line to locate the
+ * lines holding the range.
+ */
+static ssize_t read_range_image(DrgData *drg, size_t offset, size_t len,
+                                unsigned char *dst)
+{
+	unsigned char probe[256];
+	unsigned char *text, *data;
+	size_t width, stride, per_line, first, last, a = 0, b;
+	ssize_t n;
+
+	n = read_range_coded(drg, IMAGE, 0, sizeof(probe), probe);
+	if (n < 0)
+		return -1;
+
+	for (width = 0; width < (size_t) n; width++) {
+		if (probe[width] == '\r' || probe[width] == '\n')
+			break;
+	}
+	stride = width;
+	while (stride < (size_t) n &&
+	       (probe[stride] == '\r' || probe[stride] == '\n'))
+		stride++;
+
+	if (width == (size_t) n && (size_t) n == sizeof(probe))
+		return read_range_full(drg, IMAGE, offset, len, dst);
+	if (width == 0 || width % 4 != 0 || stride == (size_t) n)
+		return read_range_full(drg, IMAGE, offset, len, dst);
+
+	if (len == 0)
+		return 0;
+
+	per_line = width / 4;
+	b = offset / 3;
+	first = (b / per_line) * stride + (b % per_line) * 4;
+	b = (offset + len - 1) / 3;
+	last = (b / per_line) * stride + (b % per_line) * 4 + 4;
+
+	text = malloc(last - first);
+	if (text == NULL) {
+		drg->error = DRG_ENOMEM;
+		return -1;
 	}
 
-	data = base64_encode(drg->data[element], drg->len[element]);
+	n = read_range_coded(drg, IMAGE, first, last - first, text);
+	if (n < 0) {
+		free(text);
+		return -1;
+	}
 
+	/* Every line but the last must have the width of the first one */
+	for (b = 0; b < (size_t) n; b++) {
+		if (((first + b) % stride < width) == is_base64(text[b]))
+			continue;
+		for (a = b; a < (size_t) n; a++) {
+			if (text[a] != '\r' && text[a] != '\n')
+				break;
+		}
+		if (a < (size_t) n || is_base64(text[b])) {
+			free(text);
+			return read_range_full(drg, IMAGE, offset, len, dst);
+		}
+		n = (ssize_t) b;
+		break;
+	}
 	a = 0;
-	b = strlen(data);
+
+	data = base64_decode((const char *) text, (size_t) n, &a);
+	free(text);
+	if (data == NULL) {
+		if (n == 0)
+			return 0;
+		drg->error = DRG_ENOMEM;
+		return -1;
+	}
+
+	b = offset % 3;
+	if (a <= b)
+		len = 0;
+	else if (len > a - b)
+		len = a - b;
+	memcpy(dst, data + b, len);
+	free(data);
+
+	return (ssize_t) len;
+}
+
+ssize_t drg_read_range(DrgData *drg, int element, size_t offset,
+                       size_t len, unsigned char *dst)
+{
+	assert(drg != NULL);
+	if (element >= MAX_ELEMENTS) {
+		drg->error = DRG_EELEMENT;
+		return -1;
+	}
+
+	if (element == IMAGE)
+		return read_range_image(drg, offset, len, dst);
+
+	return read_range_coded(drg, element, offset, len, dst);
+}
+
+/*
+ * Writes base64 data in lines of linesize characters ended by CRLF,
+ * linesize -1 writes everything in one line.
+ */
+static void write_lines(const char *data, size_t b, FILE *fd, int linesize)
+{
+	size_t a = 0;
 
 	if (linesize == -1) {
 		fwrite(data, sizeof(char), b, fd);
@@ -261,6 +611,181 @@ void drg_dump_to_file(DrgData *drg, int element, FILE *fd, int linesize)
 			}
 		}
 	}
+}
+
+int drg_dump_to_file(DrgData *drg, int element, FILE *fd, int linesize)
+{
+	unsigned char *ciphered;
+	char *data;
+	struct cipher_ c;
+	size_t a = 0, b = 0;
+
+	if (element >= MAX_ELEMENTS)
+		return drg->error = DRG_EELEMENT;
+
+	a = drg->len[element];
+	if (a == 0)
+		return DRG_OK;
+
+	ciphered = malloc(a);
+	if (ciphered == NULL)
+		return drg->error = DRG_ENOMEM;
+
+	cipher_init(&c);
+	for (b = 0; b < a; b++)
+		ciphered[b] = drg->data[element][b] ^ cipher_next(&c);
+
+	data = base64_encode(ciphered, a);
+	free(ciphered);
+	if (data == NULL)
+		return drg->error = DRG_ENOMEM;
+
+	write_lines(data, strlen(data), fd, linesize);
 	free(data);
+
+	if (ferror(fd))
+		return drg->error = DRG_EIO;
+
+	return DRG_OK;
+}
+
+/*
+ * Copies len characters to *dst in lines like write_lines(), col is the
+ * column reached by the previous calls.
+ */
+static void put_lines(char **dst, int *col, const unsigned char *data,
+                      size_t len, int linesize)
+{
+	size_t i;
+
+	if (linesize == -1) {
+		memcpy(*dst, data, len);
+		*dst += len;
+		return;
+	}
+
+	while (len > 0) {
+		i = (size_t) (linesize - *col);
+		if (i > len)
+			i = len;
+		memcpy(*dst, data, i);
+		*dst += i;
+		data += i;
+		len -= i;
+		*col += (int) i;
+		if (*col == linesize) {
+			*(*dst)++ = '\r';
+			*(*dst)++ = '\n';
+			*col = 0;
+		}
+	}
+}
+
+size_t drg_dump_coded_size(size_t len, int linesize)
+{
+	if (linesize == -1)
+		return len;
+
+	return len + 2 * (len / (size_t) linesize);
+}
+
+size_t drg_dump_size(size_t len, int linesize)
+{
+	return drg_dump_coded_size((len + 2) / 3 * 4, linesize);
+}
+
+size_t drg_dump_coded_to_buffer(DrgData *drg, int element, char *dst,
+                                int linesize)
+{
+	char *p = dst;
+	int col = 0;
+
+	if (element >= MAX_ELEMENTS)
+		return 0;
+
+	put_lines(&p, &col, drg->data[element], drg->len[element], linesize);
+
+	return (size_t) (p - dst);
 }
 
+struct drg_encoder_ {
+	struct cipher_ c;
+	unsigned char in[3];
+	int n;
+	char *start;
+	char *dst;
+	int col;
+	int linesize;
+};
+
+DrgEncoder *drg_encoder_new(char *dst, int linesize)
+{
+	DrgEncoder *enc;
+
+	enc = malloc(sizeof(*enc));
+	if (enc == NULL)
+		return NULL;
+
+	cipher_init(&enc->c);
+	enc->n = 0;
+	enc->start = dst;
+	enc->dst = dst;
+	enc->col = 0;
+	enc->linesize = linesize;
+
+	return enc;
+}
+
+void drg_encoder_add(DrgEncoder *enc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned char out[4096];
+	size_t n = 0;
+
+	while (len--) {
+		enc->in[enc->n++] = *p++ ^ cipher_next(&enc->c);
+		if (enc->n < 3)
+			continue;
+		encodeblock(enc->in, out + n, 3);
+		enc->n = 0;
+		n += 4;
+		if (n == sizeof(out)) {
+			put_lines(&enc->dst, &enc->col, out, n, enc->linesize);
+			n = 0;
+		}
+	}
+	put_lines(&enc->dst, &enc->col, out, n, enc->linesize);
+}
+
+size_t drg_encoder_finish(DrgEncoder *enc)
+{
+	unsigned char out[4];
+	size_t written;
+	int i;
+
+	if (enc->n) {
+		for (i = enc->n; i < 3; i++)
+			enc->in[i] = 0;
+		encodeblock(enc->in, out, enc->n);
+		put_lines(&enc->dst, &enc->col, out, 4, enc->linesize);
+	}
+	written = (size_t) (enc->dst - enc->start);
+	free(enc);
+
+	return written;
+}
+
+int drg_dump_coded_to_file(DrgData *drg, int element, FILE *fd,
+                           int linesize)
+{
+	if (element >= MAX_ELEMENTS)
+		return drg->error = DRG_EELEMENT;
+
+	write_lines((const char *) drg->data[element], drg->len[element], fd,
+	            linesize);
+
+	if (ferror(fd))
+		return drg->error = DRG_EIO;
+
+	return DRG_OK;
+}
@@ -20,6 +20,8 @@
 #ifndef DRG_DATA_H
 #define DRG_DATA_H
 
+#include <sys/types.h>
+
 enum drg_elements {
     HEADER = 0,
     TITLE,
@@ -29,16 +31,163 @@ enum drg_elements {
     MAX_ELEMENTS
 };
 
+/*
+ * Error codes, functions failing store the error in the DrgData so it
+ * can be retrieved with drg_error(). The functions never print.
+ */
+enum drg_errors {
+    DRG_OK = 0,
+    DRG_ENOMEM,
+    DRG_EELEMENT,
+    DRG_EDECODE,
+    DRG_EIO
+};
+
+/*
+ * Stages of the decoding of an element, reported to the trace function
+ * of a DrgData.
+ */
+enum drg_stages {
+    DRG_STAGE_BASE64 = 0,
+    DRG_STAGE_CIPHER,
+    DRG_STAGE_IMAGE
+};
+
+/*
+ * Called when a stage begins (begin = 1) and ends (begin = 0), size is
+ * the number of bytes the stage processes.
+ */
+typedef void (*drg_trace_fn)(int stage, int begin, size_t size, void *arg);
+
+/*
+ * A DrgData holds no reference to global state, different threads can
+ * use different DrgData objects without locking.
+ */
 typedef struct drgdata_ DrgData;
 
 DrgData *drg_data_new(void);
 
 void drg_data_free(DrgData *drg);
 
-void drg_add_byte(DrgData *drg, int element, int byte);
+/*
+ * Reads a drg file, the elements are stored as they are in the file
+ * (encoded) without line breaks. Returns NULL on error, the reason is
+ * stored in error if not NULL.
+ */
+DrgData *drg_data_read(FILE *fd, int *error);
+
+/*
+ * Returns the number of sections of the file read into drg, counting
+ * the header. complete, if not NULL, is set to 1 if the file ends with
+ * the end mark (an empty section closed by @), a well formed file has
+ * five sections and is complete.
+ */
+int drg_section_count(DrgData *drg, int *complete);
+
+/*
+ * Returns the last error of a function called on drg.
+ */
+int drg_error(DrgData *drg);
+
+/*
+ * Returns a description of an error code.
+ */
+const char *drg_strerror(int error);
+
+/*
+ * Returns a description of an element, for messages.
+ */
+const char *drg_element_name(int element);
+
+/*
+ * Returns the name of a decoding stage, for traces.
+ */
+const char *drg_stage_name(int stage);
+
+/*
+ * Sets a function called at each stage of the decoding of drg, NULL to
+ * disable it.
+ */
+void drg_set_trace(DrgData *drg, drg_trace_fn fn, void *arg);
+
+/*
+ * Returns DRG_OK or an error code.
+ */
+int drg_add_byte(DrgData *drg, int element, int byte);
 
+/*
+ * Decodes an element, the returned data should be freed after use.
+ * Returns NULL on error.
+ */
 unsigned char *drg_get_uncoded_data(DrgData *drg, int element, size_t *len);
 
-void drg_dump_to_file(DrgData *drg, int element, FILE *fd, int linesize);
+/*
+ * Returns the element as it is stored (encoded, without line breaks),
+ * the returned buffer belongs to drg and must not be freed.
+ */
+const unsigned char *drg_get_coded_data(DrgData *drg, int element,
+                                        size_t *len);
+
+/*
+ * Decodes len bytes of the element starting at offset into dst, only
+ * the part of the element holding the range is decoded. For the image
+ * the range refers to the decoded image. The keystream read so far is
+ * kept in drg until drg_data_free().
+ *
+ * returns   number of bytes stored in dst (less than len at the end of
+ *           the element) or -1 on error
+ */
+ssize_t drg_read_range(DrgData *drg, int element, size_t offset,
+                       size_t len, unsigned char *dst);
+
+/*
+ * Encodes an element and writes it in lines of linesize characters
+ * (-1 for a single line). Returns DRG_OK or an error code.
+ */
+int drg_dump_to_file(DrgData *drg, int element, FILE *fd, int linesize);
+
+/*
+ * Writes an element read from a drg file as it is stored, without
+ * decoding it again. Returns DRG_OK or an error code.
+ */
+int drg_dump_coded_to_file(DrgData *drg, int element, FILE *fd,
+                           int linesize);
+
+/*
+ * Returns the number of bytes drg_dump_to_file() writes for an element
+ * of len bytes, and drg_dump_coded_to_file() for one stored as len
+ * bytes, so a file can be laid out before it is encoded.
+ */
+size_t drg_dump_size(size_t len, int linesize);
+
+size_t drg_dump_coded_size(size_t len, int linesize);
+
+/*
+ * Copies an element as it is stored to dst, in lines like
+ * drg_dump_coded_to_file(). Returns the number of bytes written.
+ */
+size_t drg_dump_coded_to_buffer(DrgData *drg, int element, char *dst,
+                                int linesize);
+
+/*
+ * Encodes an element straight into memory, giving the same bytes as
+ * drg_dump_to_file() without holding the element: its data can be
+ * added in pieces of any length as it is read.
+ */
+typedef struct drg_encoder_ DrgEncoder;
+
+/*
+ * dst must hold drg_dump_size() bytes for the length of the element.
+ * Returns NULL if out of memory.
+ */
+DrgEncoder *drg_encoder_new(char *dst, int linesize);
+
+void drg_encoder_add(DrgEncoder *enc, const void *data, size_t len);
+
+/*
+ * Writes the end of the element and frees the encoder. Returns the
+ * number of bytes written to dst.
+ */
+size_t drg_encoder_finish(DrgEncoder *enc);
 
 #endif /* DRG_DATA_H */
@@ -23,20 +23,93 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <locale.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "drgdata.h"
 #include "base64.h"
+#include "hash.h"
+#include "watch.h"
+#include "workpool.h"
+#include "shard.h"
+#include "index.h"
+#include "journal.h"
+#include "trace.h"
+#include "pack.h"
+#include "render.h"
+#include "audio.h"
+#include "handoff.h"
 #include "config.h"
 
+/* Files already converted in watch mode, kept in the output directory */
+#define STATE_FILE ".drg2sbg-state"
+
+struct options {
+	int raw;
+	const char *image_store;
+	const char *out_dir;
+	Manifest *manifest;
+	Journal *journal;
+	int resume;
+	PackWriter *pack;
+	long long mem_budget;
+	const char *memfd_socket;
+};
+
+struct batch {
+	struct options *opts;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+/* Extension of the output files written to a directory, by raw element */
+static const char *output_ext[] = {
+	".sbg", ".header", ".title", ".bmp", ".txt", ".sbg"
+};
+
 
 static void print_usage(char *prog_name)
 {
 	fprintf(stderr, "please use: %s [options] drgfile\n", prog_name);
+	fprintf(stderr, "       %s [options] -O dir drgfile...\n", prog_name);
+	fprintf(stderr, "       %s --index index drgfile...\n", prog_name);
+	fprintf(stderr, "       %s --query index term...\n", prog_name);
 	fprintf(stderr, "where options are:\n");
 	fprintf(stderr, "   -v         Print program version and exit\n");
 	fprintf(stderr, "   -o file    Write to file (default to stdout)\n");
 	fprintf(stderr, "   -r element Output raw element\n");
+	fprintf(stderr, "   -I dir     Store images once in dir (with -r 3)\n");
+	fprintf(stderr, "   -W dir     Watch dir and convert new drg files\n");
+	fprintf(stderr, "   -O dir     Output directory for watch and batch "
+	        "mode\n");
+	fprintf(stderr, "   -j jobs    Number of conversions run at once\n");
+	fprintf(stderr, "   -S K/N     Convert only shard K of N of the "
+	        "files\n");
+	fprintf(stderr, "   -R         Resume a batch, skipping files already "
+	        "converted\n");
+	fprintf(stderr, "   -M size    Memory the conversions run at once may "
+	        "use\n");
+	fprintf(stderr, "   -x index   Add the files to a search index\n");
+	fprintf(stderr, "   -q index   Print the files of the index holding "
+	        "every term\n");
+	fprintf(stderr, "   -T file    Write a trace of the conversions to "
+	        "file\n");
+	fprintf(stderr, "   -P pack    Convert the files into a single pack "
+	        "file\n");
+	fprintf(stderr, "   -L pack    List the files of a pack\n");
+	fprintf(stderr, "   -a file    Render the sbagen data to a WAV or "
+	        "FLAC file\n");
+	fprintf(stderr, "   -l time    Length of the audio, by default until "
+	        "the last entry\n");
+	fprintf(stderr, "   -V         Check the files without converting "
+	        "them\n");
+	fprintf(stderr, "   -F socket  Pass the result in a sealed memory file "
+	        "to socket\n");
 	fprintf(stderr, "\n");
 }
 
@@ -74,61 +147,6 @@ static void print_version(void)
 	fprintf(stdout, "    GNU General Public License for more details.\n\n");
 }
 
-static int output_file_idx(int argc, char *argv[])
-{
-	int i = 1;
-	while (i < argc) {
-		if (strcmp(argv[i], "-o") == 0 ||
-		    strcmp(argv[i], "--output") == 0)
-			return ++i;
-		i++;
-	}
-	return -1;
-}
-
-static int input_file_idx(int argc, char *argv[])
-{
-	int i = 1;
-	while (i < argc) {
-		if (strcmp(argv[i], "-o") == 0 ||
-		    strcmp(argv[i], "--output") == 0)
-			i++;
-		else if (strcmp(argv[i], "-r") == 0 ||
-		         strcmp(argv[i], "--raw") == 0)
-			i++;
-		else if (strcmp(argv[i], "-v") == 0 ||
-		         strcmp(argv[i], "--version") == 0)
-			i = i;
-		else
-			return i;
-		i++;
-	}
-	return -1;
-}
-
-static int raw_output_idx(int argc, char *argv[])
-{
-	int i = 1;
-	while (i < argc) {
-		if (strcmp(argv[i], "-r") == 0 ||
-		    strcmp(argv[i], "--raw") == 0)
-			return ++i;
-		i++;
-	}
-	return -1;
-}
-
-static int check_print_version(int argc, char *argv[])
-{
-	int i = 1;
-	while (i < argc) {
-		if (strcmp(argv[i], "-v")==0 || strcmp(argv[i], "--version")==0)
-			return 1;
-		i++;
-	}
-	return 0;
-}
-
 static void print_formated(FILE *out, const char *string, size_t line_len)
 {
 	size_t size;
@@ -159,12 +177,25 @@ static void print_formated(FILE *out, const char *string, size_t line_len)
 	fputc('\n', out);
 }
 
-static void print_raw(FILE *out, DrgData *drg, int element)
+static unsigned char *decode_element(DrgData *drg, int element, size_t *len)
+{
+	unsigned char *data;
+
+	data = drg_get_uncoded_data(drg, element, len);
+	if (data == NULL)
+		fprintf(stderr, "ERROR: could not convert %s: %s\n",
+		        drg_element_name(element),
+		        drg_strerror(drg_error(drg)));
+
+	return data;
+}
+
+static int print_raw(FILE *out, DrgData *drg, int element)
 {
 	unsigned char *output = NULL;
 	size_t len = 0;
 
-	output = drg_get_uncoded_data(drg, element, &len);
+	output = decode_element(drg, element, &len);
 
 	if (output) {
 		fwrite(output, len, sizeof(unsigned char), out);
@@ -173,115 +204,1237 @@ static void print_raw(FILE *out, DrgData *drg, int element)
 
 	if (element != IMAGE)
 		fprintf(out, "\n");
+
+	return output ? 0 : -1;
 }
 
-int main(int argc, char *argv[])
+static void write_sbg(FILE *out, const char *info, const char *sbg)
+{
+	print_formated(out, info, 50);
+	fprintf(out, "\n-SE\n%s\n", sbg);
+}
+
+static int print_sbg(FILE *out, DrgData *drg)
+{
+	char *info, *output;
+
+	info = (char *) decode_element(drg, INFO, NULL);
+	output = (char *) decode_element(drg, SBG_DATA, NULL);
+	if (output == NULL) {
+		fprintf(stderr, "Error decoding drg file\n");
+		free(info);
+		return -1;
+	}
+
+	write_sbg(out, info, output);
+	free(info);
+	free(output);
+
+	return 0;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+	FILE *in, *out;
+	char buf[8192];
+	size_t n;
+	int ret = 0;
+
+	if (!(in = fopen(from, "r")))
+		return -1;
+	if (!(out = fopen(to, "w"))) {
+		fclose(in);
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, n, out) != n) {
+			ret = -1;
+			break;
+		}
+	}
+	fclose(in);
+	if (fclose(out) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+/*
+ * Stores the image in a content addressed directory, the name of the
+ * stored file is a 128 bit hash of the encoded section (two unrelated
+ * 64 bit hashes) so images already in the store are not decoded nor
+ * written again, and two images do not share a name by accident. The
+ * output file, if any, is hard linked to the stored image, otherwise the
+ * path of the stored image is printed.
+ */
+static int store_image(DrgData *drg, const char *store, const char *out_path)
+{
+	const unsigned char *coded;
+	unsigned char *img;
+	char hash[33];
+	char *path, *tmp;
+	size_t len = 0;
+	int fd, ret = -1;
+
+	coded = drg_get_coded_data(drg, IMAGE, &len);
+	hash_to_string(hash_fnv1a(coded, len, HASH_INIT), hash);
+	hash_to_string(hash_mix64(coded, len, HASH_INIT), hash + 16);
+
+	path = malloc(strlen(store) + sizeof(hash) + 1);
+	tmp = malloc(strlen(store) + sizeof(hash) + 9);
+	if (path == NULL || tmp == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	sprintf(path, "%s/%s", store, hash);
+
+	if (access(path, F_OK) != 0) {
+		img = decode_element(drg, IMAGE, &len);
+		if (img == NULL)
+			goto out;
+
+		sprintf(tmp, "%s.XXXXXX", path);
+		fd = mkstemp(tmp);
+		if (fd < 0) {
+			fprintf(stderr, "could not create file in %s: %s\n",
+			        store, strerror(errno));
+			free(img);
+			goto out;
+		}
+		fchmod(fd, 0644);
+		trace_begin("write", NULL, len);
+		if (write(fd, img, len) != (ssize_t) len || close(fd) != 0 ||
+		    rename(tmp, path) != 0) {
+			fprintf(stderr, "could not write file %s: %s\n",
+			        path, strerror(errno));
+			trace_end("write", len);
+			unlink(tmp);
+			free(img);
+			goto out;
+		}
+		trace_end("write", len);
+		free(img);
+	}
+
+	if (out_path) {
+		unlink(out_path);
+		if (link(path, out_path) != 0 && copy_file(path, out_path) != 0) {
+			fprintf(stderr, "could not write output file %s: %s\n",
+			        out_path, strerror(errno));
+			goto out;
+		}
+	} else {
+		fprintf(stdout, "%s\n", path);
+	}
+	ret = 0;
+
+out:
+	free(path);
+	free(tmp);
+	return ret;
+}
+
+static void trace_stage(int stage, int begin, size_t size, void *arg)
+{
+	(void) arg;
+
+	if (begin)
+		trace_begin(drg_stage_name(stage), NULL, size);
+	else
+		trace_end(drg_stage_name(stage), size);
+}
+
+/*
+ * Memory used to convert drg, from the length of its sections: the
+ * sections as read, in buffers doubled as they grow, every section
+ * decoded, the image encoded twice and the sbagen output.
+ */
+static long long layout_memory(DrgData *drg)
+{
+	long long alloc, cost = 64 * 1024;
+	size_t len[MAX_ELEMENTS];
+	int i;
+
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		drg_get_coded_data(drg, i, &len[i]);
+		for (alloc = 1024; alloc < (long long) len[i]; alloc *= 2)
+			;
+		cost += alloc + len[i] / 4 * 3;
+	}
+	cost += len[IMAGE] / 16 * 9;
+	cost += (len[INFO] + len[SBG_DATA]) / 4 * 3;
+
+	return cost;
+}
+
+/*
+ * Reads in_path, in a batch job with a memory budget its cost is then
+ * corrected from the layout of the file.
+ */
+static DrgData *read_drg(const char *in_path)
 {
 	FILE *drg_fp;
-	FILE *sbg_fp = NULL;
 	DrgData *drg;
-	int c, i = 0;
-	int raw = 0;
-	char *output;
+	int error;
 
-	setlocale(LC_ALL, "");
+	drg_fp = fopen(in_path, "r");
+	if (drg_fp == NULL) {
+		fprintf(stderr, "could not open file %s: %s\n", in_path,
+		        strerror(errno));
+		return NULL;
+	}
+
+	trace_begin("split", NULL, -1);
+	drg = drg_data_read(drg_fp, &error);
+	trace_end("split", ftell(drg_fp));
+	fclose(drg_fp);
+	if (drg == NULL) {
+		fprintf(stderr, "could not read file %s: %s\n", in_path,
+		        drg_strerror(error));
+		return NULL;
+	}
+	if (trace_enabled())
+		drg_set_trace(drg, trace_stage, NULL);
+	workpool_set_cost(layout_memory(drg));
+
+	return drg;
+}
+
+/*
+ * Converts the drg file in_path, the result is written to out_path or
+ * to stdout when out_path is NULL, or handed to the memfd socket of the
+ * options.
+ */
+static int convert_file(const char *in_path, const char *out_path,
+                        const struct options *opts)
+{
+	FILE *sbg_fp = stdout;
+	DrgData *drg;
+	long size;
+	const char *name;
+	int memfd = -1, fd;
+	int ret;
+
+	trace_begin("convert", in_path, -1);
 
-	i = check_print_version(argc, argv);
-	if (i) {
-		print_version();
-		return EXIT_SUCCESS;
+	drg = read_drg(in_path);
+	if (drg == NULL) {
+		ret = -1;
+		goto out;
 	}
 
-	i = input_file_idx(argc, argv);
-	if (i > 0) {
-		drg_fp = fopen(argv[i], "r");
-		if (drg_fp == NULL) {
-			fprintf(stderr, "could not open file %s: %s\n", argv[i],
+	if (opts->image_store) {
+		ret = store_image(drg, opts->image_store, out_path);
+		drg_data_free(drg);
+		goto out;
+	}
+
+	if (opts->memfd_socket) {
+		/* Written through a duplicate, memfd stays open to be sent */
+		name = strrchr(in_path, '/');
+		memfd = handoff_create(name ? name + 1 : in_path);
+		fd = memfd >= 0 ? dup(memfd) : -1;
+		sbg_fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+		if (sbg_fp == NULL) {
+			if (fd >= 0)
+				close(fd);
+			fprintf(stderr, "could not create memory file: %s\n",
 			        strerror(errno));
-			return EXIT_FAILURE;
+			drg_data_free(drg);
+			ret = -1;
+			goto out;
+		}
+	} else if (out_path) {
+		sbg_fp = fopen(out_path, "w");
+		if (sbg_fp == NULL) {
+			fprintf(stderr, "could not open output file %s: %s\n",
+			        out_path, strerror(errno));
+			drg_data_free(drg);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	/* The output is buffered, what is left is flushed by the write */
+	trace_begin("format", NULL, -1);
+	if (opts->raw == 0)
+		ret = print_sbg(sbg_fp, drg);
+	else
+		ret = print_raw(sbg_fp, drg, opts->raw - 1);
+	size = ftell(sbg_fp);
+	trace_end("format", size);
+
+	trace_begin("write", NULL, size);
+	if (sbg_fp != stdout && fclose(sbg_fp) != 0) {
+		if (memfd >= 0)
+			fprintf(stderr, "could not write memory file: %s\n",
+			        strerror(errno));
+		else
+			fprintf(stderr, "could not write output file %s: %s\n",
+			        out_path, strerror(errno));
+		ret = -1;
+	} else if (sbg_fp == stdout) {
+		fflush(stdout);
+	}
+	trace_end("write", size);
+
+	if (memfd >= 0 && ret == 0 &&
+	    handoff_send(memfd, opts->memfd_socket,
+	                 output_ext[opts->raw] + 1) != 0) {
+		fprintf(stderr, "could not pass the result to %s: %s\n",
+		        opts->memfd_socket, strerror(errno));
+		ret = -1;
+	}
+
+	drg_data_free(drg);
+
+out:
+	if (memfd >= 0)
+		close(memfd);
+	trace_end("convert", -1);
+	return ret;
+}
+
+/*
+ * Renders the sbagen data of in_path as audio into out_path.
+ */
+static int render_file(const char *in_path, const char *out_path,
+                       double length, int jobs)
+{
+	DrgData *drg;
+	char *sbg;
+	int ret = -1;
+
+	trace_begin("convert", in_path, -1);
+
+	drg = read_drg(in_path);
+	if (drg == NULL)
+		goto out;
+
+	sbg = (char *) decode_element(drg, SBG_DATA, NULL);
+	drg_data_free(drg);
+	if (sbg == NULL)
+		goto out;
+
+	trace_begin("render", NULL, -1);
+	ret = audio_write(sbg, out_path, length, jobs);
+	trace_end("render", -1);
+	free(sbg);
+
+out:
+	trace_end("convert", -1);
+	return ret;
+}
+
+/*
+ * Like decode_element() but an empty element is an empty string.
+ */
+static unsigned char *decode_text(DrgData *drg, int element, size_t *len)
+{
+	size_t coded = 0;
+
+	drg_get_coded_data(drg, element, &coded);
+	if (coded == 0) {
+		*len = 0;
+		return (unsigned char *) strdup("");
+	}
+
+	return decode_element(drg, element, len);
+}
+
+/*
+ * Decodes the drg file in_path and adds it to the pack, name is the
+ * name of the file in the pack.
+ */
+static int pack_file(const char *in_path, const char *name,
+                     const struct options *opts)
+{
+	struct pack_item item;
+	unsigned char *data[PACK_BLOBS];
+	static const int elements[PACK_BLOBS] = {
+		-1, HEADER, TITLE, INFO, SBG_DATA, IMAGE
+	};
+	char *sbg = NULL;
+	size_t sbg_len = 0;
+	DrgData *drg;
+	FILE *out;
+	int i, ret = -1;
+
+	memset(data, 0, sizeof(data));
+	trace_begin("convert", in_path, -1);
+
+	drg = read_drg(in_path);
+	if (drg == NULL)
+		goto out;
+
+	item.data[PACK_NAME] = name;
+	item.len[PACK_NAME] = strlen(name);
+	for (i = PACK_HEADER; i < PACK_BLOBS; i++) {
+		if (i == PACK_SBG)
+			continue;
+		data[i] = decode_text(drg, elements[i], &item.len[i]);
+		if (data[i] == NULL)
+			goto out;
+		item.data[i] = data[i];
+	}
+
+	trace_begin("format", NULL, -1);
+	data[PACK_SBG] = decode_element(drg, SBG_DATA, NULL);
+	out = data[PACK_SBG] ? open_memstream(&sbg, &sbg_len) : NULL;
+	if (out) {
+		write_sbg(out, (char *) data[PACK_DESCRIPTION],
+		          (char *) data[PACK_SBG]);
+		if (fclose(out) != 0) {
+			free(sbg);
+			sbg = NULL;
+		}
+	}
+	trace_end("format", sbg_len);
+	if (sbg == NULL) {
+		if (data[PACK_SBG])
+			fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	item.data[PACK_SBG] = sbg;
+	item.len[PACK_SBG] = sbg_len;
+
+	trace_begin("write", NULL, -1);
+	ret = pack_writer_add(opts->pack, &item);
+	trace_end("write", -1);
+	if (ret != 0)
+		fprintf(stderr, "could not add %s to the pack\n", in_path);
+
+out:
+	for (i = 0; i < PACK_BLOBS; i++)
+		free(data[i]);
+	free(sbg);
+	if (drg)
+		drg_data_free(drg);
+	trace_end("convert", -1);
+	return ret;
+}
+
+/* Length of the name of a file without its .drg extension */
+static size_t stem_length(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > 4 && strcasecmp(name + len - 4, ".drg") == 0)
+		len -= 4;
+
+	return len;
+}
+
+/*
+ * Converts in_path into the output directory, the output is written to
+ * a temporary file renamed into place once complete so readers of the
+ * output directory never see partial files. In batch mode the output
+ * is recorded in the journal, and with resume inputs already converted
+ * are skipped if their output is still intact.
+ */
+static int convert_to_dir(const char *in_path, const char *name, void *arg)
+{
+	const struct options *opts = arg;
+	uint64_t in_hash = HASH_INIT;
+	uint64_t out_hash = HASH_INIT;
+	long long size = 0;
+	char *path, *tmp;
+	size_t len;
+	int fd, done = 0, ret = -1;
+
+	len = stem_length(name);
+
+	path = malloc(strlen(opts->out_dir) + len + 16);
+	tmp = malloc(strlen(opts->out_dir) + len + 24);
+	if (path == NULL || tmp == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	sprintf(path, "%s/%.*s%s", opts->out_dir, (int) len, name,
+	        output_ext[opts->raw]);
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	if (opts->journal) {
+		if (hash_file(in_path, &in_hash, NULL) != 0) {
+			fprintf(stderr, "could not read file %s: %s\n",
+			        in_path, strerror(errno));
+			goto out;
+		}
+		done = opts->resume &&
+		       journal_done(opts->journal, in_path, in_hash, path,
+		                    &size, &out_hash);
+	}
+
+	if (!done) {
+		fd = mkstemp(tmp);
+		if (fd < 0) {
+			fprintf(stderr, "could not create file in %s: %s\n",
+			        opts->out_dir, strerror(errno));
+			goto out;
+		}
+		fchmod(fd, 0644);
+		close(fd);
+
+		if (convert_file(in_path, tmp, opts) != 0 ||
+		    (opts->journal && journal_sync_file(tmp) != 0) ||
+		    rename(tmp, path) != 0) {
+			unlink(tmp);
+			goto out;
+		}
+
+		if ((opts->manifest || opts->journal) &&
+		    hash_file(path, &out_hash, &size) != 0) {
+			fprintf(stderr, "could not read file %s: %s\n",
+			        path, strerror(errno));
+			goto out;
+		}
+		if (opts->journal &&
+		    journal_add(opts->journal, in_path, in_hash, path,
+		                out_hash) != 0) {
+			fprintf(stderr, "could not write the journal: %s\n",
+			        strerror(errno));
+			goto out;
+		}
+	}
+
+	if (opts->manifest &&
+	    manifest_add(opts->manifest, in_path, path, size, out_hash) != 0) {
+		fprintf(stderr, "could not add %s to the manifest\n", path);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(path);
+	free(tmp);
+	return ret;
+}
+
+static void batch_job(void *job, void *arg)
+{
+	struct shard_item *item = job;
+	struct batch *b = arg;
+	int ret;
+
+	if (b->opts->pack)
+		ret = pack_file(item->data, item->key, b->opts);
+	else
+		ret = convert_to_dir(item->data, item->key, b->opts);
+
+	if (ret != 0) {
+		pthread_mutex_lock(&b->lock);
+		b->failed++;
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+static int compare_stems(const void *a, const void *b)
+{
+	const struct shard_item *x = *(const struct shard_item * const *) a;
+	const struct shard_item *y = *(const struct shard_item * const *) b;
+	size_t lx = stem_length(x->key), ly = stem_length(y->key);
+	int c;
+
+	c = strncmp(x->key, y->key, lx < ly ? lx : ly);
+	if (c != 0 || lx == ly)
+		return c;
+
+	return lx < ly ? -1 : 1;
+}
+
+/*
+ * Outputs are named after the input without its directory, two inputs
+ * with the same name would overwrite each other's output.
+ *
+ * returns   0 if the names are unique, -1 otherwise
+ */
+static int check_names(struct shard_item *items, int count)
+{
+	struct shard_item **sorted;
+	int i, ret = 0;
+
+	sorted = malloc((count + 1) * sizeof(*sorted));
+	if (sorted == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++)
+		sorted[i] = &items[i];
+	qsort(sorted, count, sizeof(*sorted), compare_stems);
+
+	for (i = 1; i < count; i++) {
+		if (compare_stems(&sorted[i - 1], &sorted[i]) == 0) {
+			fprintf(stderr, "%s and %s have the same output name\n",
+			        (char *) sorted[i - 1]->data,
+			        (char *) sorted[i]->data);
+			ret = -1;
+		}
+	}
+	free(sorted);
+
+	return ret;
+}
+
+/*
+ * Picks the files of the shard, the items returned point into files and
+ * must be freed after use.
+ *
+ * returns   number of items or -1 on error
+ */
+static int select_files(char **files, int count, const char *shard,
+                        int *k, int *n, struct shard_item **items)
+{
+	struct stat st;
+	char *name;
+	int i;
+
+	*k = *n = 1;
+	if (shard && shard_parse(shard, k, n) != 0) {
+		fprintf(stderr, "invalid shard %s, must be K/N\n", shard);
+		return -1;
+	}
+
+	*items = calloc(count, sizeof(**items));
+	if (*items == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		name = strrchr(files[i], '/');
+		(*items)[i].key = name ? name + 1 : files[i];
+		(*items)[i].size = stat(files[i], &st) == 0 ? st.st_size : 0;
+		(*items)[i].data = files[i];
+	}
+
+	/* Checked on the whole list, so every shard fails the same way */
+	if (check_names(*items, count) != 0) {
+		free(*items);
+		return -1;
+	}
+
+	count = shard_select(*items, count, *k, *n);
+	if (count < 0) {
+		fprintf(stderr, "Out of memory\n");
+		free(*items);
+	}
+
+	return count;
+}
+
+/*
+ * Estimates the memory used to convert a drg file of size bytes before
+ * it is read, the most layout_memory() gives for a file of that size:
+ * every byte in the description or sbagen section.
+ */
+static long long estimate_memory(long long size)
+{
+	return 64 * 1024 + size / 2 * 7;
+}
+
+/* Biggest jobs first, the small ones then fill what the budget leaves */
+static int compare_cost(const void *a, const void *b)
+{
+	const struct shard_item *x = a;
+	const struct shard_item *y = b;
+
+	if (x->size != y->size)
+		return x->size > y->size ? -1 : 1;
+
+	return strcmp(x->key, y->key);
+}
+
+/*
+ * Parses a size in bytes, optionally followed by K, M or G.
+ */
+static int parse_size(const char *str, long long *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoll(str, &end, 10);
+	if (errno || end == str || *size < 0)
+		return -1;
+
+	switch (*end) {
+	case 'G': case 'g':
+		*size *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		*size *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		*size *= 1024;
+		end++;
+		break;
+	}
+
+	return *end ? -1 : 0;
+}
+
+/*
+ * Runs batch_job() on the items using jobs threads. With a memory
+ * budget the items are reordered by the memory they are expected to
+ * use, which replaces their size.
+ *
+ * returns   number of failed jobs or -1 if the threads could not start
+ */
+static int run_jobs(struct shard_item *items, int count, int jobs,
+                    struct options *opts)
+{
+	struct batch b;
+	WorkPool *pool;
+	int i;
+
+	b.opts = opts;
+	b.failed = 0;
+	pthread_mutex_init(&b.lock, NULL);
+
+	pool = workpool_new(jobs, batch_job, &b);
+	if (pool == NULL) {
+		fprintf(stderr, "could not start workers\n");
+		pthread_mutex_destroy(&b.lock);
+		return -1;
+	}
+	if (opts->mem_budget) {
+		for (i = 0; i < count; i++)
+			items[i].size = estimate_memory(items[i].size);
+		qsort(items, count, sizeof(*items), compare_cost);
+		workpool_set_budget(pool, opts->mem_budget);
+	}
+	for (i = 0; i < count; i++) {
+		if (workpool_add_cost(pool, &items[i],
+		                      opts->mem_budget ? items[i].size : 0) == 0)
+			continue;
+		fprintf(stderr, "could not convert %s: Out of memory\n",
+		        items[i].key);
+		pthread_mutex_lock(&b.lock);
+		b.failed++;
+		pthread_mutex_unlock(&b.lock);
+	}
+	workpool_free(pool);
+
+	pthread_mutex_destroy(&b.lock);
+
+	return b.failed;
+}
+
+/*
+ * Converts files into the output directory using jobs threads. With a
+ * shard only its part of the files is converted, the outputs are listed
+ * in a manifest written to the output directory.
+ */
+static int run_batch(char **files, int count, int jobs, const char *shard,
+                     struct options *opts)
+{
+	struct shard_item *items;
+	char *name;
+	int failed, k, n;
+
+	count = select_files(files, count, shard, &k, &n, &items);
+	if (count < 0)
+		return -1;
+
+	name = malloc(strlen(opts->out_dir) + 40);
+	if (name == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(items);
+		return -1;
+	}
+	sprintf(name, "%s/journal-%d-of-%d", opts->out_dir, k, n);
+	opts->journal = journal_open(name, opts->resume);
+	free(name);
+	if (opts->journal == NULL) {
+		free(items);
+		return -1;
+	}
+
+	opts->manifest = manifest_new(opts->out_dir, k, n);
+	failed = opts->manifest ? run_jobs(items, count, jobs, opts) : -1;
+
+	if (opts->manifest && manifest_close(opts->manifest) != 0)
+		failed = -1;
+	opts->manifest = NULL;
+	journal_close(opts->journal);
+	opts->journal = NULL;
+
+	free(items);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * Converts files, or the files of a shard, into a single pack.
+ */
+static int run_pack(char **files, int count, int jobs, const char *shard,
+                    const char *pack, struct options *opts)
+{
+	struct shard_item *items;
+	int failed, k, n;
+
+	count = select_files(files, count, shard, &k, &n, &items);
+	if (count < 0)
+		return -1;
+
+	opts->pack = pack_writer_new(pack);
+	if (opts->pack == NULL) {
+		free(items);
+		return -1;
+	}
+
+	failed = run_jobs(items, count, jobs, opts);
+	if (pack_writer_close(opts->pack, failed != 0) != 0)
+		failed = -1;
+	opts->pack = NULL;
+
+	free(items);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * Prints the key, name and title of every file in a pack.
+ */
+static int list_pack(const char *path, FILE *out)
+{
+	const char *name, *title;
+	char key[17];
+	Pack *p;
+	int i, ret = 0;
+
+	p = pack_open(path);
+	if (p == NULL)
+		return -1;
+
+	for (i = 0; i < pack_count(p); i++) {
+		name = pack_view(p, i, PACK_NAME, NULL);
+		title = pack_view(p, i, PACK_TITLE, NULL);
+		if (name == NULL || title == NULL) {
+			fprintf(stderr, "entry %d of %s is damaged\n", i + 1,
+			        path);
+			ret = -1;
+			continue;
+		}
+		hash_to_string(pack_entry_key(p, i), key);
+		fprintf(out, "%s\t%s\t%s\n", key, name, title);
+	}
+	pack_close(p);
+
+	return ret;
+}
+
+/*
+ * A file checked by --verify, report holds its failures.
+ */
+struct verify_job {
+	const char *path;
+	char *report;
+	size_t len;
+	int failed;
+};
+
+static const char *image_type(const unsigned char *data, size_t len)
+{
+	if (len >= 2 && memcmp(data, "BM", 2) == 0)
+		return "bmp";
+	if (len >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0)
+		return "jpeg";
+	if (len >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+		return "png";
+	if (len >= 6 && (memcmp(data, "GIF87a", 6) == 0 ||
+	                 memcmp(data, "GIF89a", 6) == 0))
+		return "gif";
+
+	return NULL;
+}
+
+/*
+ * Returns the offset of the first character of a section that is not
+ * base64, or -1.
+ */
+static long invalid_base64(const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (!isalnum(data[i]) && data[i] != '+' && data[i] != '/' &&
+		    data[i] != '=')
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Runs every check on a file, each failure is reported as a line with
+ * the file, the check and the reason separated by tabs.
+ */
+static int verify_file(const char *path, FILE *out)
+{
+	static const char *checks[MAX_ELEMENTS] = {
+		"header", "title", "image", "description", "sbagen"
+	};
+	const unsigned char *raw;
+	unsigned char *data[MAX_ELEMENTS];
+	char error[128];
+	size_t len[MAX_ELEMENTS], coded;
+	DrgData *drg;
+	FILE *fp;
+	long bad;
+	int i, n, complete, failed = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(out, "%s\tread\t%s\n", path, strerror(errno));
+		return 1;
+	}
+	trace_begin("split", NULL, -1);
+	drg = drg_data_read(fp, &i);
+	trace_end("split", ftell(fp));
+	fclose(fp);
+	if (drg == NULL) {
+		fprintf(out, "%s\tread\t%s\n", path, drg_strerror(i));
+		return 1;
+	}
+	if (trace_enabled())
+		drg_set_trace(drg, trace_stage, NULL);
+
+	n = drg_section_count(drg, &complete);
+	if (n != MAX_ELEMENTS) {
+		fprintf(out, "%s\tsections\t%d sections, %d expected\n", path, n,
+		        MAX_ELEMENTS);
+		failed++;
+	} else if (!complete) {
+		fprintf(out, "%s\tsections\tmissing end mark\n", path);
+		failed++;
+	}
+
+	/* The title and description may be empty */
+	for (i = 0; i < MAX_ELEMENTS; i++) {
+		raw = drg_get_coded_data(drg, i, &coded);
+		data[i] = NULL;
+		len[i] = 0;
+		if (coded == 0 && (i == TITLE || i == INFO))
+			continue;
+		if ((bad = invalid_base64(raw, coded)) >= 0) {
+			fprintf(out, "%s\t%s\tinvalid character at offset %ld\n",
+			        path, checks[i], bad);
+			failed++;
+			continue;
+		}
+		data[i] = drg_get_uncoded_data(drg, i, &len[i]);
+		if (data[i] == NULL) {
+			fprintf(out, "%s\t%s\t%s\n", path, checks[i],
+			        coded ? drg_strerror(drg_error(drg)) : "empty");
+			failed++;
 		}
+	}
+
+	if (data[SBG_DATA] &&
+	    render_check((char *) data[SBG_DATA], error, sizeof(error)) != 0) {
+		fprintf(out, "%s\tscript\t%s\n", path, error);
+		failed++;
+	}
+	if (data[IMAGE] && image_type(data[IMAGE], len[IMAGE]) == NULL) {
+		fprintf(out, "%s\tsignature\tunknown image format\n", path);
+		failed++;
+	}
+
+	for (i = 0; i < MAX_ELEMENTS; i++)
+		free(data[i]);
+	drg_data_free(drg);
+
+	return failed;
+}
+
+static void verify_job(void *job, void *arg)
+{
+	struct verify_job *v = job;
+	FILE *out;
+
+	(void) arg;
+
+	trace_begin("verify", v->path, -1);
+	out = open_memstream(&v->report, &v->len);
+	if (out == NULL) {
+		v->failed = -1;
 	} else {
-		print_usage(argv[0]);
-		return EXIT_FAILURE;
+		v->failed = verify_file(v->path, out);
+		if (fclose(out) != 0)
+			v->failed = -1;
 	}
+	trace_end("verify", -1);
+}
 
-	i = output_file_idx(argc, argv);
-	if (i > 0) {
-		if (i < argc) {
-			sbg_fp = fopen(argv[i], "w");
-			if (sbg_fp == NULL) {
-				fprintf(stderr,
-				        "could not open output file %s: %s\n",
-				        argv[i], strerror(errno));
-				return EXIT_FAILURE;
-			}
-		} else {
-			fprintf(stderr,
-			        "could not open output file (not specified)\n");
-			return EXIT_FAILURE;
+/*
+ * Checks files on jobs threads without writing any output, the failures
+ * are printed in the order of the files.
+ */
+static int run_verify(char **files, int count, int jobs, FILE *out)
+{
+	struct verify_job *v;
+	WorkPool *pool;
+	int i, failed = 0;
+
+	v = calloc(count, sizeof(*v));
+	pool = v ? workpool_new(jobs, verify_job, NULL) : NULL;
+	if (pool == NULL) {
+		fprintf(stderr, "could not start workers\n");
+		free(v);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		v[i].path = files[i];
+		if (workpool_add(pool, &v[i]) != 0)
+			v[i].failed = -1;
+	}
+	workpool_free(pool);
+
+	for (i = 0; i < count; i++) {
+		if (v[i].failed < 0) {
+			fprintf(stderr, "could not verify %s: Out of memory\n",
+			        v[i].path);
+			failed++;
+		} else if (v[i].failed > 0) {
+			fwrite(v[i].report, 1, v[i].len, out);
+			failed++;
 		}
+		free(v[i].report);
 	}
+	free(v);
+
+	fprintf(stderr, "%d of %d files failed\n", failed, count);
+
+	return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opts;
+	char *out_path = NULL;
+	char *watch = NULL;
+	char *shard = NULL;
+	char *index = NULL;
+	char *query = NULL;
+	char *trace = NULL;
+	char *pack = NULL;
+	char *pack_list = NULL;
+	char *audio = NULL;
+	double length = 0;
+	int verify = 0;
+	char *state;
+	int jobs = 0;
+	int ret;
+
+	int opt;
+	int option_index;
+
+	struct option long_option[] = {
+		{"output", 1, 0, 'o'},
+		{"raw", 1, 0, 'r'},
+		{"image-store", 1, 0, 'I'},
+		{"watch", 1, 0, 'W'},
+		{"out", 1, 0, 'O'},
+		{"jobs", 1, 0, 'j'},
+		{"shard", 1, 0, 'S'},
+		{"resume", 0, 0, 'R'},
+		{"mem-budget", 1, 0, 'M'},
+		{"index", 1, 0, 'x'},
+		{"query", 1, 0, 'q'},
+		{"trace", 1, 0, 'T'},
+		{"pack", 1, 0, 'P'},
+		{"pack-list", 1, 0, 'L'},
+		{"audio", 1, 0, 'a'},
+		{"length", 1, 0, 'l'},
+		{"verify", 0, 0, 'V'},
+		{"memfd-socket", 1, 0, 'F'},
+		{"version", 0, 0, 'v'},
+		{0,0,0,0}
+	};
+
+	setlocale(LC_ALL, "");
+	memset(&opts, 0, sizeof(opts));
 
-	i = raw_output_idx(argc, argv);
-	if (i > 0) {
-		if (i < argc) {
-			raw = atoi(argv[i]);
-			if (raw < 1 || raw > 5) {
+	while ((opt = getopt_long(argc, argv, "o:r:I:W:O:j:S:RM:x:q:T:P:L:a:l:VF:v",
+	                          long_option, &option_index)) != -1) {
+		switch (opt) {
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'r':
+			opts.raw = atoi(optarg);
+			if (opts.raw < 1 || opts.raw > 5) {
 				print_raw_usage(argv[0]);
 				return EXIT_FAILURE;
 			}
-		} else {
-			print_raw_usage(argv[0]);
+			break;
+		case 'I':
+			opts.image_store = optarg;
+			break;
+		case 'W':
+			watch = optarg;
+			break;
+		case 'O':
+			opts.out_dir = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'S':
+			shard = optarg;
+			break;
+		case 'R':
+			opts.resume = 1;
+			break;
+		case 'M':
+			if (parse_size(optarg, &opts.mem_budget) != 0) {
+				fprintf(stderr, "invalid size %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'x':
+			index = optarg;
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'P':
+			pack = optarg;
+			break;
+		case 'L':
+			pack_list = optarg;
+			break;
+		case 'a':
+			audio = optarg;
+			break;
+		case 'V':
+			verify = 1;
+			break;
+		case 'F':
+			opts.memfd_socket = optarg;
+			break;
+		case 'l':
+			if (render_parse_time(optarg, &length) != 0) {
+				fprintf(stderr, "invalid length %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			print_version();
+			return EXIT_SUCCESS;
+		default:
+			print_usage(argv[0]);
 			return EXIT_FAILURE;
 		}
 	}
-	i = 0;
 
-	drg = drg_data_new();
-	/* The header is a special element, not separated by @ */
-	while (( c = fgetc(drg_fp)) != EOF) {
-		if (c == '\n' || c == '\r' || c == '@')
-			break;
-		else
-			drg_add_byte(drg, i, c);
+	if (opts.image_store && opts.raw != IMAGE + 1) {
+		fprintf(stderr, "-I can only be used with '-r 3'\n");
+		return EXIT_FAILURE;
+	}
+
+	if (opts.memfd_socket && (out_path || opts.image_store ||
+	                          opts.out_dir || watch || index || query ||
+	                          pack || pack_list || audio || verify)) {
+		fprintf(stderr, "--memfd-socket only converts a single file, "
+		        "with no other output\n");
+		return EXIT_FAILURE;
+	}
+
+	if (trace && trace_open(trace) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
 	}
 
-	i = 1;
-	/* Rest of elements separated by @ */
-	while ((c = fgetc(drg_fp)) != EOF) {
-		if (c == '@') {
-			i++;
-		} else if (c != '\n' && c != '\r') {
-			drg_add_byte(drg, i, c);
+	if (watch) {
+		if (opts.out_dir == NULL) {
+			fprintf(stderr, "--watch needs an output directory "
+			        "(--out)\n");
+			ret = -1;
+			goto out;
 		}
+		state = malloc(strlen(opts.out_dir) + sizeof(STATE_FILE) + 1);
+		if (state == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			ret = -1;
+			goto out;
+		}
+		sprintf(state, "%s/%s", opts.out_dir, STATE_FILE);
+		ret = watch_dir(watch, state, jobs, convert_to_dir, &opts);
+		free(state);
+		goto out;
 	}
-	fclose(drg_fp);
 
-	if (sbg_fp == NULL)
-		sbg_fp = stdout;
+	/* Without files the index is only checked for removed files */
+	if (index) {
+		ret = index_update(index, argv + optind, argc - optind, jobs);
+		goto out;
+	}
 
-	if (raw == 0) {
-		output = (char *) drg_get_uncoded_data(drg, INFO, NULL);
-		print_formated(sbg_fp, output, 50);
-		free(output);
+	if (pack_list) {
+		ret = list_pack(pack_list, stdout);
+		goto out;
+	}
 
-		output = (char *) drg_get_uncoded_data(drg, SBG_DATA, NULL);
-		if (output == NULL) {
-			fprintf(stderr, "Error decoding drg file\n");
-			drg_data_free(drg);
-			return EXIT_FAILURE;
+	if (optind >= argc) {
+		print_usage(argv[0]);
+		ret = -1;
+		goto out;
+	}
+
+	if (query) {
+		ret = index_query(query, argv + optind, argc - optind, stdout);
+		ret = ret > 0 ? 0 : -1;
+		goto out;
+	}
+
+	if (verify) {
+		ret = run_verify(argv + optind, argc - optind, jobs, stdout);
+		goto out;
+	}
+
+	if (audio) {
+		if (argc - optind > 1) {
+			fprintf(stderr, "--audio renders a single file\n");
+			ret = -1;
+			goto out;
 		}
+		ret = render_file(argv[optind], audio, length, jobs);
+		goto out;
+	}
 
-		fprintf(sbg_fp, "\n-SE\n%s\n", output);
-		free(output);
-	} else {
-		print_raw(sbg_fp, drg, raw - 1);
+	if (pack) {
+		if (opts.raw || opts.out_dir) {
+			fprintf(stderr, "--pack can not be used with -r or "
+			        "-O\n");
+			ret = -1;
+			goto out;
+		}
+		ret = run_pack(argv + optind, argc - optind, jobs, shard, pack,
+		               &opts);
+		goto out;
 	}
 
-	if (sbg_fp != stdout)
-		fclose(sbg_fp);
+	if (opts.out_dir) {
+		ret = run_batch(argv + optind, argc - optind, jobs, shard,
+		                &opts);
+		goto out;
+	}
 
-	drg_data_free(drg);
+	if (argc - optind > 1 || shard) {
+		fprintf(stderr, "several files or a shard need an output "
+		        "directory (-O)\n");
+		ret = -1;
+		goto out;
+	}
 
-	return 0;
+	ret = convert_file(argv[optind], out_path, &opts);
+
+out:
+	if (trace_close() != 0)
+		ret = -1;
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
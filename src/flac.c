@@ -0,0 +1,638 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "flac.h"
+
+#define MAX_FIXED 4
+#define MAX_LPC 8
+#define LPC_PRECISION 14
+#define MAX_SHIFT 15
+#define MAX_PORDER 8
+#define MAX_RICE 14
+
+enum subframe_types {
+	SUB_CONSTANT,
+	SUB_VERBATIM,
+	SUB_FIXED,
+	SUB_LPC
+};
+
+/* Channel assignments of the frame header */
+enum stereo_modes {
+	STEREO_INDEPENDENT = 1,
+	STEREO_LEFT_SIDE = 8,
+	STEREO_RIGHT_SIDE = 9,
+	STEREO_MID_SIDE = 10
+};
+
+enum channels {
+	CH_LEFT,
+	CH_RIGHT,
+	CH_MID,
+	CH_SIDE
+};
+
+struct subframe_ {
+	int type;
+	int order;
+	int shift;
+	int32_t coef[MAX_LPC];
+	int porder;
+	int rice[1 << MAX_PORDER];
+	uint64_t bits;
+};
+
+struct bits_ {
+	unsigned char *buf;
+	size_t len;
+	uint64_t acc;
+	int n;
+};
+
+struct flac_ {
+	FILE *out;
+	long long frame_no;
+	int fill;
+	int32_t pcm[4][FLAC_BLOCK];
+	int32_t res[FLAC_BLOCK];
+	struct bits_ bits;
+	uint16_t crc16[256];
+};
+
+static void put_bits(struct bits_ *b, uint32_t value, int n)
+{
+	if (n < 32)
+		value &= (1U << n) - 1;
+	b->acc = b->acc << n | value;
+	b->n += n;
+	while (b->n >= 8) {
+		b->n -= 8;
+		b->buf[b->len++] = b->acc >> b->n;
+	}
+}
+
+static void put_zeros(struct bits_ *b, uint32_t n)
+{
+	while (n > 24) {
+		put_bits(b, 0, 24);
+		n -= 24;
+	}
+	put_bits(b, 0, n);
+}
+
+static void align_bits(struct bits_ *b)
+{
+	if (b->n)
+		put_bits(b, 0, 8 - b->n);
+}
+
+static uint8_t crc8(const unsigned char *data, size_t len)
+{
+	uint8_t crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+}
+
+static void crc16_init(uint16_t *table)
+{
+	uint16_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (j = 0; j < 8; j++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+		table[i] = crc;
+	}
+}
+
+static uint16_t crc16(const uint16_t *table, const unsigned char *data,
+                      size_t len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = crc << 8 ^ table[(crc >> 8) ^ *data++];
+
+	return crc;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+/*
+ * Residual of x for the predictor of sf, the first order samples are
+ * warm up samples and have no residual.
+ */
+static void compute_residual(const struct subframe_ *sf, const int32_t *x,
+                             int n, int32_t *res)
+{
+	int64_t sum;
+	int i, j;
+
+	if (sf->type == SUB_LPC) {
+		for (i = sf->order; i < n; i++) {
+			sum = 0;
+			for (j = 0; j < sf->order; j++)
+				sum += (int64_t) sf->coef[j] * x[i - 1 - j];
+			res[i] = x[i] - (int32_t) (sum >> sf->shift);
+		}
+		return;
+	}
+
+	switch (sf->order) {
+	case 0:
+		for (i = 0; i < n; i++)
+			res[i] = x[i];
+		break;
+	case 1:
+		for (i = 1; i < n; i++)
+			res[i] = x[i] - x[i - 1];
+		break;
+	case 2:
+		for (i = 2; i < n; i++)
+			res[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+		break;
+	case 3:
+		for (i = 3; i < n; i++)
+			res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+		break;
+	default:
+		for (i = 4; i < n; i++)
+			res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] -
+			         4 * x[i - 3] + x[i - 4];
+		break;
+	}
+}
+
+/* Estimated bits of count values of sum with the best rice parameter */
+static uint64_t rice_bits(uint64_t sum, uint32_t count, int *param)
+{
+	uint64_t bits, best = UINT64_MAX;
+	int k;
+
+	for (k = 0; k <= MAX_RICE; k++) {
+		bits = (uint64_t) count * (k + 1) + (sum >> k);
+		if (bits < best) {
+			best = bits;
+			*param = k;
+		}
+		if ((sum >> k) < count)
+			break;
+	}
+
+	return best;
+}
+
+/*
+ * Chooses the partition order and rice parameters of the residual,
+ * partitions are merged from the finest order.
+ */
+static uint64_t plan_residual(struct subframe_ *sf, const int32_t *res, int n)
+{
+	uint64_t sums[1 << MAX_PORDER];
+	uint64_t bits, best = UINT64_MAX;
+	int rice[1 << MAX_PORDER];
+	int p, max = 0, i, j, parts, size;
+
+	while (max < MAX_PORDER && (n & ((1 << (max + 1)) - 1)) == 0 &&
+	       (n >> (max + 1)) > sf->order)
+		max++;
+
+	parts = 1 << max;
+	size = n >> max;
+	for (i = 0; i < parts; i++) {
+		sums[i] = 0;
+		for (j = i ? i * size : sf->order; j < (i + 1) * size; j++)
+			sums[i] += zigzag(res[j]);
+	}
+
+	for (p = max; p >= 0; p--) {
+		parts = 1 << p;
+		size = n >> p;
+		if (p < max) {
+			for (i = 0; i < parts; i++)
+				sums[i] = sums[2 * i] + sums[2 * i + 1];
+		}
+		bits = 0;
+		for (i = 0; i < parts; i++)
+			bits += 4 + rice_bits(sums[i], size - (i ? 0 : sf->order),
+			                      &rice[i]);
+		if (bits < best) {
+			best = bits;
+			sf->porder = p;
+			memcpy(sf->rice, rice, parts * sizeof(*rice));
+		}
+	}
+
+	return 6 + best;
+}
+
+/*
+ * Order of the fixed predictor with the smallest residual, returns its
+ * sum of absolute values.
+ */
+static uint64_t best_fixed(const int32_t *x, int n, int *order)
+{
+	uint64_t sum[MAX_FIXED + 1] = { 0 };
+	int32_t e0, e1, e2, e3, e4;
+	int i, o, max = n > MAX_FIXED ? MAX_FIXED : n - 1;
+
+	for (i = MAX_FIXED; i < n; i++) {
+		/* Samples have at most 17 bits, the differences fit */
+		e0 = x[i];
+		e1 = e0 - x[i - 1];
+		e2 = e1 - (x[i - 1] - x[i - 2]);
+		e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+		e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+		sum[0] += abs(e0);
+		sum[1] += abs(e1);
+		sum[2] += abs(e2);
+		sum[3] += abs(e3);
+		sum[4] += abs(e4);
+	}
+
+	*order = 0;
+	for (o = 1; o <= max; o++) {
+		if (sum[o] < sum[*order])
+			*order = o;
+	}
+
+	return sum[*order];
+}
+
+/*
+ * Computes LPC coefficients with the Levinson-Durbin recursion on the
+ * autocorrelation of the windowed signal, the order is chosen from the
+ * prediction error of each order.
+ *
+ * returns   0 if a predictor was found, -1 otherwise
+ */
+static int plan_lpc(struct subframe_ *sf, const int32_t *x, int n, int bps)
+{
+	double w[FLAC_BLOCK];
+	double autoc[MAX_LPC + 1], lpc[MAX_LPC], lp[MAX_LPC][MAX_LPC];
+	double err[MAX_LPC], r, tmp, cmax, bits, best = HUGE_VAL, e;
+	int i, j, order = 0, max = MAX_LPC, log2cmax, q;
+	int qmax = (1 << (LPC_PRECISION - 1)) - 1;
+
+	for (i = 0; i < n; i++) {
+		r = (i - (n - 1) / 2.0) / ((n + 1) / 2.0);
+		w[i] = x[i] * (1 - r * r);
+	}
+	for (i = 0; i <= MAX_LPC; i++) {
+		autoc[i] = 0;
+		for (j = i; j < n; j++)
+			autoc[i] += w[j] * w[j - i];
+	}
+	if (autoc[0] <= 0)
+		return -1;
+
+	e = autoc[0];
+	for (i = 0; i < max; i++) {
+		r = -autoc[i + 1];
+		for (j = 0; j < i; j++)
+			r -= lpc[j] * autoc[i - j];
+		r /= e;
+		lpc[i] = r;
+		for (j = 0; j < i >> 1; j++) {
+			tmp = lpc[j];
+			lpc[j] += r * lpc[i - 1 - j];
+			lpc[i - 1 - j] += r * tmp;
+		}
+		if (i & 1)
+			lpc[j] += lpc[j] * r;
+		e *= 1 - r * r;
+		for (j = 0; j <= i; j++)
+			lp[i][j] = -lpc[j];
+		err[i] = e;
+		if (e <= 0) {
+			max = i + 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < max; i++) {
+		bits = err[i] > 0 ? 0.5 * log2(0.5 * err[i] / n) : 0;
+		if (bits < 0)
+			bits = 0;
+		bits = bits * (n - i - 1) + (i + 1) * (LPC_PRECISION + bps);
+		if (bits < best) {
+			best = bits;
+			order = i + 1;
+		}
+	}
+
+	cmax = 0;
+	for (i = 0; i < order; i++) {
+		if (fabs(lp[order - 1][i]) > cmax)
+			cmax = fabs(lp[order - 1][i]);
+	}
+	if (cmax <= 0)
+		return -1;
+	frexp(cmax, &log2cmax);
+	sf->shift = LPC_PRECISION - 1 - log2cmax;
+	if (sf->shift > MAX_SHIFT)
+		sf->shift = MAX_SHIFT;
+	if (sf->shift < 0)
+		return -1;
+
+	/* The rounding error is carried to the next coefficient */
+	e = 0;
+	for (i = 0; i < order; i++) {
+		e += lp[order - 1][i] * (1 << sf->shift);
+		q = lround(e);
+		if (q > qmax)
+			q = qmax;
+		else if (q < -qmax - 1)
+			q = -qmax - 1;
+		sf->coef[i] = q;
+		e -= q;
+	}
+	sf->type = SUB_LPC;
+	sf->order = order;
+
+	return 0;
+}
+
+/*
+ * Chooses the cheapest encoding of a channel, the bits of the subframe
+ * are stored in sf->bits.
+ */
+static void plan_subframe(FlacEncoder *f, struct subframe_ *sf,
+                          const int32_t *x, int n, int bps, int order)
+{
+	struct subframe_ lpc;
+	int i;
+
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+	if (i == n) {
+		sf->type = SUB_CONSTANT;
+		sf->order = 0;
+		sf->bits = 8 + bps;
+		return;
+	}
+
+	sf->type = SUB_VERBATIM;
+	sf->order = 0;
+	sf->bits = 8 + (uint64_t) n * bps;
+
+	if (n <= MAX_FIXED)
+		return;
+
+	lpc.type = SUB_FIXED;
+	lpc.order = order;
+	compute_residual(&lpc, x, n, f->res);
+	lpc.bits = 8 + order * bps + plan_residual(&lpc, f->res, n);
+	if (lpc.bits < sf->bits)
+		*sf = lpc;
+
+	if (n <= 4 * MAX_LPC || plan_lpc(&lpc, x, n, bps) != 0)
+		return;
+	compute_residual(&lpc, x, n, f->res);
+	for (i = lpc.order; i < n; i++) {
+		if (f->res[i] > (1 << 28) || f->res[i] < -(1 << 28))
+			return;
+	}
+	lpc.bits = 8 + lpc.order * bps + 4 + 5 + lpc.order * LPC_PRECISION +
+	           plan_residual(&lpc, f->res, n);
+	if (lpc.bits < sf->bits)
+		*sf = lpc;
+}
+
+static void write_subframe(FlacEncoder *f, const struct subframe_ *sf,
+                           const int32_t *x, int n, int bps)
+{
+	struct bits_ *b = &f->bits;
+	uint32_t u;
+	int i, j, k, part, size, end;
+
+	switch (sf->type) {
+	case SUB_CONSTANT:
+		put_bits(b, 0, 8);
+		put_bits(b, x[0], bps);
+		return;
+	case SUB_VERBATIM:
+		put_bits(b, 1 << 1, 8);
+		for (i = 0; i < n; i++)
+			put_bits(b, x[i], bps);
+		return;
+	case SUB_FIXED:
+		put_bits(b, (8 | sf->order) << 1, 8);
+		break;
+	default:
+		put_bits(b, (32 | (sf->order - 1)) << 1, 8);
+		break;
+	}
+
+	for (i = 0; i < sf->order; i++)
+		put_bits(b, x[i], bps);
+	if (sf->type == SUB_LPC) {
+		put_bits(b, LPC_PRECISION - 1, 4);
+		put_bits(b, sf->shift, 5);
+		for (i = 0; i < sf->order; i++)
+			put_bits(b, sf->coef[i], LPC_PRECISION);
+	}
+
+	compute_residual(sf, x, n, f->res);
+	put_bits(b, 0, 2);
+	put_bits(b, sf->porder, 4);
+	size = n >> sf->porder;
+	for (part = 0; part < 1 << sf->porder; part++) {
+		k = sf->rice[part];
+		put_bits(b, k, 4);
+		end = (part + 1) * size;
+		for (j = part ? part * size : sf->order; j < end; j++) {
+			u = zigzag(f->res[j]);
+			/* Quotient in unary, then the k low bits */
+			if ((u >> k) + k < 32) {
+				put_bits(b, 1U << k | (u & ((1U << k) - 1)),
+				         (u >> k) + k + 1);
+			} else {
+				put_zeros(b, u >> k);
+				put_bits(b, 1, 1);
+				if (k)
+					put_bits(b, u, k);
+			}
+		}
+	}
+}
+
+static void put_utf8(struct bits_ *b, uint64_t v)
+{
+	int bytes, i;
+
+	if (v < 0x80) {
+		put_bits(b, v, 8);
+		return;
+	}
+	for (bytes = 2; bytes < 7 && v >= 1ULL << (5 * bytes + 1); bytes++)
+		;
+	put_bits(b, ((0xff00 >> bytes) & 0xff) | v >> (6 * (bytes - 1)), 8);
+	for (i = bytes - 2; i >= 0; i--)
+		put_bits(b, 0x80 | ((v >> (6 * i)) & 0x3f), 8);
+}
+
+static int encode_block(FlacEncoder *f, int n)
+{
+	static const int pairs[4][3] = {
+		{ STEREO_INDEPENDENT, CH_LEFT, CH_RIGHT },
+		{ STEREO_LEFT_SIDE, CH_LEFT, CH_SIDE },
+		{ STEREO_RIGHT_SIDE, CH_SIDE, CH_RIGHT },
+		{ STEREO_MID_SIDE, CH_MID, CH_SIDE }
+	};
+	struct subframe_ sf[2];
+	struct bits_ *b = &f->bits;
+	uint64_t cost[4], c, best = UINT64_MAX;
+	int i, ch, mode = 0, order[4] = { 0 }, header;
+	uint16_t crc;
+
+	for (i = 0; i < n; i++) {
+		f->pcm[CH_MID][i] = (f->pcm[CH_LEFT][i] + f->pcm[CH_RIGHT][i]) >> 1;
+		f->pcm[CH_SIDE][i] = f->pcm[CH_LEFT][i] - f->pcm[CH_RIGHT][i];
+	}
+
+	/* The stereo mode is chosen from the fixed predictor residuals */
+	for (ch = 0; ch < 4; ch++)
+		cost[ch] = n > MAX_FIXED ? best_fixed(f->pcm[ch], n, &order[ch]) : 0;
+	for (i = 0; i < 4; i++) {
+		c = cost[pairs[i][1]] + cost[pairs[i][2]];
+		if (c < best) {
+			best = c;
+			mode = i;
+		}
+	}
+
+	b->len = 0;
+	b->n = 0;
+	put_bits(b, 0xfff8, 16);
+	put_bits(b, n == FLAC_BLOCK ? 12 : 7, 4);
+	put_bits(b, 0, 4);
+	put_bits(b, pairs[mode][0], 4);
+	put_bits(b, 4, 3);
+	put_bits(b, 0, 1);
+	put_utf8(b, f->frame_no);
+	if (n != FLAC_BLOCK)
+		put_bits(b, n - 1, 16);
+	header = b->len;
+	put_bits(b, crc8(b->buf, header), 8);
+
+	for (i = 0; i < 2; i++) {
+		ch = pairs[mode][i + 1];
+		plan_subframe(f, &sf[i], f->pcm[ch], n, ch == CH_SIDE ? 17 : 16,
+		              order[ch]);
+		write_subframe(f, &sf[i], f->pcm[ch], n, ch == CH_SIDE ? 17 : 16);
+	}
+	align_bits(b);
+	crc = crc16(f->crc16, b->buf, b->len);
+	put_bits(b, crc, 16);
+
+	f->frame_no++;
+	f->fill = 0;
+
+	return fwrite(b->buf, 1, b->len, f->out) == b->len ? 0 : -1;
+}
+
+FlacEncoder *flac_new(FILE *out, int rate, long long frames)
+{
+	struct bits_ b;
+	unsigned char header[42];
+	FlacEncoder *f;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+	/* A frame is never larger than its verbatim encoding */
+	f->bits.buf = malloc(FLAC_BLOCK * 2 * 3 + 64);
+	if (f->bits.buf == NULL) {
+		free(f);
+		return NULL;
+	}
+	f->out = out;
+	crc16_init(f->crc16);
+
+	/* Marker, then STREAMINFO as the last metadata block */
+	memset(header, 0, sizeof(header));
+	memcpy(header, "fLaC", 4);
+	b.buf = header + 4;
+	b.len = 0;
+	b.n = 0;
+	put_bits(&b, 0x80, 8);
+	put_bits(&b, 34, 24);
+	put_bits(&b, FLAC_BLOCK, 16);
+	put_bits(&b, FLAC_BLOCK, 16);
+	put_bits(&b, 0, 24);
+	put_bits(&b, 0, 24);
+	put_bits(&b, rate, 20);
+	put_bits(&b, 2 - 1, 3);
+	put_bits(&b, 16 - 1, 5);
+	put_bits(&b, frames >> 32, 4);
+	put_bits(&b, frames, 32);
+
+	if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+		free(f->bits.buf);
+		free(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+int flac_encode(FlacEncoder *f, const short *buf, int frames)
+{
+	int i;
+
+	for (i = 0; i < frames; i++) {
+		f->pcm[CH_LEFT][f->fill] = buf[2 * i];
+		f->pcm[CH_RIGHT][f->fill] = buf[2 * i + 1];
+		if (++f->fill == FLAC_BLOCK && encode_block(f, FLAC_BLOCK) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int flac_finish(FlacEncoder *f)
+{
+	int ret = 0;
+
+	if (f->fill)
+		ret = encode_block(f, f->fill);
+
+	free(f->bits.buf);
+	free(f);
+
+	return ret;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_FLAC_H
+#define DRG_FLAC_H
+
+#include <stdio.h>
+
+/*
+ * Encoder of 16 bit stereo FLAC streams. Samples are encoded in fixed
+ * size blocks, each channel with the best of a fixed predictor and an
+ * LPC predictor, and the stereo pair as left/right, mid/side or one
+ * side with the difference of the channels.
+ */
+
+#define FLAC_BLOCK 4096
+
+typedef struct flac_ FlacEncoder;
+
+/*
+ * Writes the stream header to out, frames is the number of frames
+ * (pairs of samples) that will be encoded.
+ */
+FlacEncoder *flac_new(FILE *out, int rate, long long frames);
+
+/*
+ * Encodes interleaved frames, they are buffered until a block is full.
+ *
+ * returns   0 on success, -1 on error
+ */
+int flac_encode(FlacEncoder *f, const short *buf, int frames);
+
+/*
+ * Encodes the last block and frees the encoder.
+ *
+ * returns   0 on success, -1 on error
+ */
+int flac_finish(FlacEncoder *f);
+
+#endif /* DRG_FLAC_H */
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+
+int handoff_create(const char *name)
+{
+	return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+int handoff_send(int fd, const char *socket_path, const char *kind)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat st;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	char line[64];
+	int sock, len, ret = -1;
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	          F_SEAL_WRITE | F_SEAL_SEAL) != 0 || fstat(fd, &st) != 0)
+		return -1;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+		goto out;
+
+	len = snprintf(line, sizeof(line), "%lld %s\n",
+	               (long long) st.st_size, kind);
+	iov.iov_base = line;
+	iov.iov_len = (size_t) len;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) == len)
+		ret = 0;
+
+out:
+	close(sock);
+	return ret;
+}
+
+#else /* HAVE_MEMFD_CREATE */
+
+int handoff_create(const char *name)
+{
+	(void) name;
+	errno = ENOSYS;
+	return -1;
+}
+
+int handoff_send(int fd, const char *socket_path, const char *kind)
+{
+	(void) fd;
+	(void) socket_path;
+	(void) kind;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* HAVE_MEMFD_CREATE */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_HANDOFF_H
+#define DRG_HANDOFF_H
+
+/*
+ * Hands the result of a conversion to another process without copying
+ * it: the result is written to an anonymous memory file which is sealed
+ * and passed over a Unix socket, the receiver maps it directly.
+ */
+
+/*
+ * Creates a memory file that can be sealed, name is only shown in
+ * /proc. Returns a file descriptor, or -1 with errno set.
+ */
+int handoff_create(const char *name);
+
+/*
+ * Seals the memory file fd so its size and content can no longer
+ * change, connects to the stream socket socket_path and sends fd with
+ * the line "size kind\n". fd is left open.
+ *
+ * returns   0 or -1 with errno set
+ */
+int handoff_send(int fd, const char *socket_path, const char *kind);
+
+#endif /* DRG_HANDOFF_H */
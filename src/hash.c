@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "hash.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t hash_fnv1a(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	uint64_t h = seed;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+/* Finalizer of MurmurHash3, every input bit affects every output bit */
+static uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+/* Little endian word of n <= 8 bytes, the same on every host */
+static uint64_t read_le(const unsigned char *p, size_t n)
+{
+	uint64_t k = 0;
+
+	while (n-- > 0)
+		k = (k << 8) | p[n];
+
+	return k;
+}
+
+uint64_t hash_mix64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t k;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		k = read_le(p + i, 8);
+		h ^= fmix64(k);
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+	}
+	if (i < len) {
+		k = read_le(p + i, len - i);
+		h ^= fmix64(k ^ 0x87c37b91114253d5ULL);
+	}
+
+	return fmix64(h);
+}
+
+int hash_file(const char *path, uint64_t *hash, long long *size)
+{
+	FILE *fp;
+	char buf[65536];
+	long long total = 0;
+	size_t len;
+	int ret = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		*hash = hash_fnv1a(buf, len, *hash);
+		total += (long long) len;
+	}
+	if (ferror(fp))
+		ret = -1;
+	fclose(fp);
+
+	if (size)
+		*size = total;
+
+	return ret;
+}
+
+void hash_to_string(uint64_t hash, char *str)
+{
+	sprintf(str, "%016llx", (unsigned long long) hash);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_HASH_H
+#define DRG_HASH_H
+
+#include <stdint.h>
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/*
+ * 64 bit FNV-1a hash, can be chained by passing the previous result
+ * as seed (use HASH_INIT for the first block).
+ *
+ * data      data to hash
+ * len       size of the data
+ * seed      HASH_INIT or the hash of the preceding data
+ * returns   the hash value
+ */
+uint64_t hash_fnv1a(const void *data, size_t len, uint64_t seed);
+
+/*
+ * 64 bit hash unrelated to FNV-1a, used with it where a 64 bit name is
+ * too narrow to rule out collisions. Words of 8 bytes are mixed with the
+ * MurmurHash3 finalizer, read little endian so the result is the same
+ * on every host.
+ */
+uint64_t hash_mix64(const void *data, size_t len, uint64_t seed);
+
+/*
+ * Hashes the contents of a file, chained to seed.
+ *
+ * path      file to hash
+ * hash      on input the seed, on output the hash
+ * size      if not NULL, the size of the file
+ * returns   0 on success, -1 if the file could not be read
+ */
+int hash_file(const char *path, uint64_t *hash, long long *size);
+
+/*
+ * Formats a hash as 16 lowercase hexadecimal digits.
+ *
+ * hash      hash value
+ * str       buffer of at least 17 bytes
+ */
+void hash_to_string(uint64_t hash, char *str);
+
+#endif /* DRG_HASH_H */
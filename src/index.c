@@ -0,0 +1,767 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "drgdata.h"
+#include "workpool.h"
+#include "hash.h"
+
+#define INDEX_MAGIC "drg2sbg-index 1"
+#define TOKEN_BUCKETS 65536
+#define MAX_TOKEN 64
+
+/*
+ * The index file is made of text lines, a header, one line per file:
+ *
+ *   F <size> <mtime> <path>
+ *
+ * and one line per token, sorted, with the files holding it numbered
+ * in the order of the F lines:
+ *
+ *   T <token> <file> <file>...
+ */
+
+struct doc_ {
+	char *path;
+	long long size;
+	long long mtime;
+	int alive;
+	int id;
+};
+
+struct token_ {
+	char *text;
+	int *ids;
+	int count;
+	int alloc;
+	struct token_ *next;
+};
+
+struct index_ {
+	struct doc_ *docs;
+	int ndocs;
+	int alloc;
+	struct token_ *table[TOKEN_BUCKETS];
+	int ntokens;
+};
+
+struct tokens_ {
+	char **text;
+	int count;
+	int alloc;
+};
+
+struct job_ {
+	const char *path;
+	long long size;
+	long long mtime;
+	struct tokens_ tokens;
+	int ok;
+};
+
+static void tokens_add(struct tokens_ *t, const char *text, size_t len)
+{
+	char **tmp;
+	char *s;
+	size_t i;
+
+	if (len < 2 || len > MAX_TOKEN)
+		return;
+
+	if (t->count == t->alloc) {
+		tmp = realloc(t->text, (t->alloc * 2 + 64) * sizeof(*tmp));
+		if (tmp == NULL)
+			return;
+		t->text = tmp;
+		t->alloc = t->alloc * 2 + 64;
+	}
+
+	s = malloc(len + 1);
+	if (s == NULL)
+		return;
+	for (i = 0; i < len; i++)
+		s[i] = (char) tolower((unsigned char) text[i]);
+	s[len] = '\0';
+	t->text[t->count++] = s;
+}
+
+static int is_word(unsigned char c)
+{
+	return isalnum(c) || c >= 0x80;
+}
+
+static void add_words(struct tokens_ *t, const char *text, size_t len)
+{
+	size_t i = 0, start;
+
+	while (i < len) {
+		while (i < len && !is_word((unsigned char) text[i]))
+			i++;
+		start = i;
+		while (i < len && is_word((unsigned char) text[i]))
+			i++;
+		tokens_add(t, text + start, i - start);
+	}
+}
+
+/*
+ * Adds "<prefix>:<value>" with the number written in a canonical way,
+ * so 200, 200.0 and 200.00 are the same token.
+ */
+static void add_number(struct tokens_ *t, const char *prefix, double value)
+{
+	char buf[MAX_TOKEN];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%s:%g", prefix, value);
+	if (len > 0 && len < (int) sizeof(buf))
+		tokens_add(t, buf, (size_t) len);
+}
+
+static void add_tone(struct tokens_ *t, const char *word, size_t len)
+{
+	static const char *noises[] = { "pink", "white", "brown", NULL };
+	char buf[MAX_TOKEN];
+	char *end;
+	double carrier, beat;
+	int i;
+
+	if (len >= sizeof(buf))
+		return;
+	memcpy(buf, word, len);
+	buf[len] = '\0';
+
+	for (i = 0; noises[i]; i++) {
+		size_t n = strlen(noises[i]);
+		if (strncmp(buf, noises[i], n) == 0 && buf[n] == '/') {
+			snprintf(buf, sizeof(buf), "noise:%s", noises[i]);
+			tokens_add(t, buf, strlen(buf));
+			return;
+		}
+	}
+
+	carrier = strtod(buf, &end);
+	if (end == buf)
+		return;
+	if (*end == '/') {
+		add_number(t, "carrier", carrier);
+	} else if (*end == '+' || *end == '-') {
+		beat = strtod(end + 1, &end);
+		if (*end != '/')
+			return;
+		add_number(t, "carrier", carrier);
+		add_number(t, "beat", beat);
+	}
+}
+
+static void add_sbagen(struct tokens_ *t, const char *text)
+{
+	const char *line, *end, *comment, *p, *w;
+
+	for (line = text; *line; line = *end ? end + 1 : end) {
+		end = line + strcspn(line, "\n");
+		comment = memchr(line, '#', (size_t) (end - line));
+		if (comment)
+			add_words(t, comment, (size_t) (end - comment));
+		else
+			comment = end;
+
+		for (p = line; p < comment; ) {
+			while (p < comment && isspace((unsigned char) *p))
+				p++;
+			w = p;
+			while (p < comment && !isspace((unsigned char) *p))
+				p++;
+			if (p > w)
+				add_tone(t, w, (size_t) (p - w));
+		}
+	}
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int compare_tokens(const void *a, const void *b)
+{
+	const struct token_ *const *x = a;
+	const struct token_ *const *y = b;
+	return strcmp((*x)->text, (*y)->text);
+}
+
+static void index_job(void *data, void *arg)
+{
+	struct job_ *job = data;
+	DrgData *drg;
+	FILE *fp;
+	char *text;
+	int i, n, error;
+
+	(void) arg;
+
+	fp = fopen(job->path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "could not open file %s: %s\n", job->path,
+		        strerror(errno));
+		return;
+	}
+	drg = drg_data_read(fp, &error);
+	fclose(fp);
+	if (drg == NULL) {
+		fprintf(stderr, "could not read file %s: %s\n", job->path,
+		        drg_strerror(error));
+		return;
+	}
+
+	text = (char *) drg_get_uncoded_data(drg, SBG_DATA, NULL);
+	if (text == NULL) {
+		fprintf(stderr, "ERROR: could not convert %s of %s: %s\n",
+		        drg_element_name(SBG_DATA), job->path,
+		        drg_strerror(drg_error(drg)));
+		drg_data_free(drg);
+		return;
+	}
+	add_sbagen(&job->tokens, text);
+	free(text);
+
+	text = (char *) drg_get_uncoded_data(drg, INFO, NULL);
+	if (text) {
+		add_words(&job->tokens, text, strlen(text));
+		free(text);
+	}
+	text = (char *) drg_get_uncoded_data(drg, TITLE, NULL);
+	if (text) {
+		add_words(&job->tokens, text, strlen(text));
+		free(text);
+	}
+	drg_data_free(drg);
+
+	qsort(job->tokens.text, job->tokens.count, sizeof(char *),
+	      compare_strings);
+	for (i = 0, n = 0; i < job->tokens.count; i++) {
+		if (n > 0 && strcmp(job->tokens.text[n - 1],
+		                    job->tokens.text[i]) == 0)
+			free(job->tokens.text[i]);
+		else
+			job->tokens.text[n++] = job->tokens.text[i];
+	}
+	job->tokens.count = n;
+	job->ok = 1;
+}
+
+static struct token_ *lookup_token(struct index_ *idx, const char *text)
+{
+	struct token_ *t;
+	unsigned int b;
+
+	b = hash_fnv1a(text, strlen(text), HASH_INIT) % TOKEN_BUCKETS;
+	for (t = idx->table[b]; t; t = t->next) {
+		if (strcmp(t->text, text) == 0)
+			return t;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL || (t->text = strdup(text)) == NULL) {
+		free(t);
+		return NULL;
+	}
+	t->next = idx->table[b];
+	idx->table[b] = t;
+	idx->ntokens++;
+
+	return t;
+}
+
+static int posting_add(struct token_ *t, int id)
+{
+	int *tmp;
+
+	if (t->count == t->alloc) {
+		tmp = realloc(t->ids, (t->alloc * 2 + 4) * sizeof(*tmp));
+		if (tmp == NULL)
+			return -1;
+		t->ids = tmp;
+		t->alloc = t->alloc * 2 + 4;
+	}
+	t->ids[t->count++] = id;
+
+	return 0;
+}
+
+static int doc_add(struct index_ *idx, const char *path, long long size,
+                   long long mtime)
+{
+	struct doc_ *tmp;
+
+	if (idx->ndocs == idx->alloc) {
+		tmp = realloc(idx->docs, (idx->alloc * 2 + 64) * sizeof(*tmp));
+		if (tmp == NULL)
+			return -1;
+		idx->docs = tmp;
+		idx->alloc = idx->alloc * 2 + 64;
+	}
+	tmp = &idx->docs[idx->ndocs];
+	tmp->path = strdup(path);
+	if (tmp->path == NULL)
+		return -1;
+	tmp->size = size;
+	tmp->mtime = mtime;
+	tmp->alive = 1;
+
+	return idx->ndocs++;
+}
+
+static int index_load(struct index_ *idx, const char *path)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t alloc = 0;
+	ssize_t len;
+	long long size, mtime;
+	struct token_ *t;
+	char *p, *end;
+	int n, ret = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return errno == ENOENT ? 0 : -1;
+
+	len = getline(&line, &alloc, fp);
+	if (len != (ssize_t) strlen(INDEX_MAGIC) + 1 ||
+	    strcmp(line, INDEX_MAGIC "\n") != 0) {
+		fprintf(stderr, "%s is not an index file\n", path);
+		ret = -1;
+	}
+
+	while (ret == 0 && (len = getline(&line, &alloc, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (line[0] == 'F') {
+			if (sscanf(line, "F %lld %lld %n", &size, &mtime,
+			           &n) < 2 ||
+			    doc_add(idx, line + n, size, mtime) < 0)
+				ret = -1;
+		} else if (line[0] == 'T' && line[1] == ' ') {
+			p = strchr(line + 2, ' ');
+			if (p)
+				*p++ = '\0';
+			t = lookup_token(idx, line + 2);
+			if (t == NULL) {
+				ret = -1;
+				break;
+			}
+			while (p && *p) {
+				n = (int) strtol(p, &end, 10);
+				if (end == p || n < 0 || n >= idx->ndocs ||
+				    posting_add(t, n) < 0) {
+					ret = -1;
+					break;
+				}
+				p = end;
+			}
+		}
+	}
+
+	if (ret != 0)
+		fprintf(stderr, "could not read index %s\n", path);
+	free(line);
+	fclose(fp);
+
+	return ret;
+}
+
+static int index_write(struct index_ *idx, const char *path)
+{
+	struct token_ **tokens, *t;
+	char *tmp;
+	FILE *fp;
+	int i, j, n, id = 0, ret = -1;
+
+	tokens = malloc((idx->ntokens + 1) * sizeof(*tokens));
+	tmp = malloc(strlen(path) + 5);
+	if (tokens == NULL || tmp == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	for (i = 0, n = 0; i < TOKEN_BUCKETS; i++) {
+		for (t = idx->table[i]; t; t = t->next)
+			tokens[n++] = t;
+	}
+	qsort(tokens, n, sizeof(*tokens), compare_tokens);
+
+	sprintf(tmp, "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "could not open file %s: %s\n", tmp,
+		        strerror(errno));
+		goto out;
+	}
+
+	fprintf(fp, "%s\n", INDEX_MAGIC);
+	for (i = 0; i < idx->ndocs; i++) {
+		if (!idx->docs[i].alive)
+			continue;
+		idx->docs[i].id = id++;
+		fprintf(fp, "F %lld %lld %s\n", idx->docs[i].size,
+		        idx->docs[i].mtime, idx->docs[i].path);
+	}
+
+	for (i = 0; i < n; i++) {
+		t = tokens[i];
+		for (j = 0; j < t->count && !idx->docs[t->ids[j]].alive; j++)
+			;
+		if (j == t->count)
+			continue;
+		fprintf(fp, "T %s", t->text);
+		for (; j < t->count; j++) {
+			if (idx->docs[t->ids[j]].alive)
+				fprintf(fp, " %d", idx->docs[t->ids[j]].id);
+		}
+		fputc('\n', fp);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "could not write index %s: %s\n", path,
+		        strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(tokens);
+	free(tmp);
+	return ret;
+}
+
+static void index_free(struct index_ *idx)
+{
+	struct token_ *t;
+	int i;
+
+	for (i = 0; i < TOKEN_BUCKETS; i++) {
+		while ((t = idx->table[i]) != NULL) {
+			idx->table[i] = t->next;
+			free(t->text);
+			free(t->ids);
+			free(t);
+		}
+	}
+	for (i = 0; i < idx->ndocs; i++)
+		free(idx->docs[i].path);
+	free(idx->docs);
+	free(idx);
+}
+
+static int compare_docs(const void *a, const void *b)
+{
+	const struct doc_ *const *x = a;
+	const struct doc_ *const *y = b;
+	return strcmp((*x)->path, (*y)->path);
+}
+
+int index_update(const char *index_path, char **files, int count, int jobs)
+{
+	struct index_ *idx;
+	struct doc_ **sorted = NULL, key, *pkey = &key, **found;
+	struct job_ *job = NULL;
+	struct token_ *t;
+	struct stat st;
+	WorkPool *pool;
+	long long mtime;
+	int i, j, id, ndocs, njobs = 0, ret = -1;
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	if (index_load(idx, index_path) != 0)
+		goto out;
+
+	ndocs = idx->ndocs;
+	sorted = malloc((ndocs + 1) * sizeof(*sorted));
+	job = calloc(count + 1, sizeof(*job));
+	if (sorted == NULL || job == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	for (i = 0; i < ndocs; i++) {
+		if (stat(idx->docs[i].path, &st) != 0)
+			idx->docs[i].alive = 0;
+		sorted[i] = &idx->docs[i];
+	}
+	qsort(sorted, ndocs, sizeof(*sorted), compare_docs);
+
+	for (i = 0; i < count; i++) {
+		if (stat(files[i], &st) != 0) {
+			fprintf(stderr, "could not open file %s: %s\n",
+			        files[i], strerror(errno));
+			continue;
+		}
+		key.path = files[i];
+		found = bsearch(&pkey, sorted, ndocs, sizeof(*sorted),
+		                compare_docs);
+		mtime = (long long) st.st_mtim.tv_sec * 1000000000LL +
+		        st.st_mtim.tv_nsec;
+		if (found && (*found)->alive &&
+		    (*found)->size == (long long) st.st_size &&
+		    (*found)->mtime == mtime)
+			continue;
+		if (found) {
+			if (!(*found)->alive)
+				continue;
+			(*found)->alive = 0;
+		}
+		job[njobs].path = files[i];
+		job[njobs].size = (long long) st.st_size;
+		job[njobs].mtime = mtime;
+		njobs++;
+	}
+
+	pool = workpool_new(jobs, index_job, NULL);
+	if (pool == NULL) {
+		fprintf(stderr, "could not start workers\n");
+		goto out;
+	}
+	/* The stale entries are already dropped, so a lost job fails it all */
+	for (i = 0; i < njobs; i++) {
+		if (workpool_add(pool, &job[i]) != 0)
+			break;
+	}
+	workpool_free(pool);
+	if (i < njobs) {
+		fprintf(stderr, "could not index %s: Out of memory\n",
+		        job[i].path);
+		goto out;
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (!job[i].ok)
+			continue;
+		id = doc_add(idx, job[i].path, job[i].size, job[i].mtime);
+		if (id < 0) {
+			fprintf(stderr, "Out of memory\n");
+			goto out;
+		}
+		for (j = 0; j < job[i].tokens.count; j++) {
+			t = lookup_token(idx, job[i].tokens.text[j]);
+			if (t == NULL || posting_add(t, id) < 0) {
+				fprintf(stderr, "Out of memory\n");
+				goto out;
+			}
+		}
+	}
+
+	ret = index_write(idx, index_path);
+
+out:
+	if (job) {
+		for (i = 0; i < njobs; i++) {
+			for (j = 0; j < job[i].tokens.count; j++)
+				free(job[i].tokens.text[j]);
+			free(job[i].tokens.text);
+		}
+	}
+	free(job);
+	free(sorted);
+	index_free(idx);
+
+	return ret;
+}
+
+/*
+ * Finds the line of token in the sorted token lines between start and
+ * end, returns a pointer to the first file number or NULL.
+ */
+static const char *find_token(const char *start, const char *end,
+                              const char *token)
+{
+	const char *lo = start, *hi = end, *mid, *line, *next;
+	size_t len = strlen(token);
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		line = mid;
+		while (line > lo && line[-1] != '\n')
+			line--;
+		next = memchr(line, '\n', (size_t) (end - line));
+		next = next ? next + 1 : end;
+
+		cmp = strncmp(line + 2, token, len);
+		if (cmp == 0 && line[2 + len] != ' ' && line[2 + len] != '\n')
+			cmp = 1;
+		if (cmp == 0)
+			return line + 2 + len;
+		if (cmp < 0)
+			lo = next;
+		else
+			hi = line;
+	}
+
+	return NULL;
+}
+
+/*
+ * Query terms are written as the tokens in the index.
+ */
+static void normalize_term(const char *term, char *buf, size_t size)
+{
+	const char *prefixes[] = { "carrier:", "beat:", NULL };
+	double value;
+	char *end;
+	size_t i;
+
+	for (i = 0; term[i] && i < size - 1; i++)
+		buf[i] = (char) tolower((unsigned char) term[i]);
+	buf[i] = '\0';
+
+	for (i = 0; prefixes[i]; i++) {
+		size_t n = strlen(prefixes[i]);
+		if (strncmp(buf, prefixes[i], n) == 0) {
+			value = strtod(buf + n, &end);
+			if (end != buf + n && *end == '\0')
+				snprintf(buf + n, size - n, "%g", value);
+		}
+	}
+}
+
+int index_query(const char *index_path, char **terms, int count, FILE *out)
+{
+	FILE *fp;
+	char *data = NULL, *p, *end, *tokens;
+	const char **paths = NULL;
+	const char *ids;
+	char term[MAX_TOKEN + 16];
+	int *result = NULL;
+	int i, j, n, nresult = -1, ndocs = 0, alloc = 0;
+	long size;
+	char *next;
+
+	fp = fopen(index_path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "could not open index %s: %s\n", index_path,
+		        strerror(errno));
+		return -1;
+	}
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) != 0 ||
+	    (data = malloc((size_t) size + 1)) == NULL ||
+	    fread(data, 1, (size_t) size, fp) != (size_t) size) {
+		fprintf(stderr, "could not read index %s\n", index_path);
+		fclose(fp);
+		free(data);
+		return -1;
+	}
+	fclose(fp);
+	data[size] = '\0';
+	end = data + size;
+
+	if (strncmp(data, INDEX_MAGIC "\n", strlen(INDEX_MAGIC) + 1) != 0) {
+		fprintf(stderr, "%s is not an index file\n", index_path);
+		free(data);
+		return -1;
+	}
+
+	/* File lines come first, numbered in order */
+	p = data + strlen(INDEX_MAGIC) + 1;
+	while (p < end && p[0] == 'F') {
+		if (ndocs == alloc) {
+			const char **tmp;
+			alloc = alloc * 2 + 64;
+			tmp = realloc(paths, alloc * sizeof(*paths));
+			if (tmp == NULL) {
+				nresult = -1;
+				goto out;
+			}
+			paths = tmp;
+		}
+		next = strchr(p, '\n');
+		if (next)
+			*next++ = '\0';
+		else
+			next = end;
+		/* Skip "F <size> <mtime> " */
+		paths[ndocs] = p;
+		for (i = 0; i < 3 && paths[ndocs]; i++) {
+			paths[ndocs] = strchr(paths[ndocs], ' ');
+			if (paths[ndocs])
+				paths[ndocs]++;
+		}
+		if (paths[ndocs] == NULL)
+			paths[ndocs] = "";
+		ndocs++;
+		p = next;
+	}
+	tokens = p;
+
+	for (i = 0; i < count; i++) {
+		normalize_term(terms[i], term, sizeof(term));
+		ids = find_token(tokens, end, term);
+		if (ids == NULL) {
+			nresult = 0;
+			break;
+		}
+
+		if (nresult < 0) {
+			result = malloc((ndocs + 1) * sizeof(*result));
+			if (result == NULL)
+				goto out;
+			for (nresult = 0; *ids == ' '; ) {
+				n = (int) strtol(ids, (char **) &ids, 10);
+				if (n >= 0 && n < ndocs)
+					result[nresult++] = n;
+			}
+		} else {
+			/* Both lists are sorted */
+			for (j = 0, n = 0; *ids == ' ' && j < nresult; ) {
+				int id = (int) strtol(ids, (char **) &ids, 10);
+				while (j < nresult && result[j] < id)
+					j++;
+				if (j < nresult && result[j] == id)
+					result[n++] = result[j++];
+			}
+			nresult = n;
+		}
+	}
+
+	for (i = 0; i < nresult; i++)
+		fprintf(out, "%s\n", paths[result[i]]);
+
+out:
+	if (nresult < 0)
+		fprintf(stderr, "Out of memory\n");
+	free(result);
+	free(paths);
+	free(data);
+
+	return nresult;
+}
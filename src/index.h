@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_INDEX_H
+#define DRG_INDEX_H
+
+/*
+ * Adds the drg files to the index in index_path, creating it if needed.
+ * Files already in the index and not modified since are not decoded
+ * again, files that no longer exist are removed. Files are decoded on
+ * jobs threads.
+ *
+ * The index holds the words of the title, description and sbagen
+ * comments, and the tones of the sbagen data as carrier:<hz>,
+ * beat:<hz> and noise:<type>.
+ *
+ * returns   0 on success, -1 on error
+ */
+int index_update(const char *index_path, char **files, int count, int jobs);
+
+/*
+ * Prints the files of the index holding every term.
+ *
+ * returns   number of files found, -1 on error
+ */
+int index_query(const char *index_path, char **terms, int count, FILE *out);
+
+#endif /* DRG_INDEX_H */
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "journal.h"
+#include "hash.h"
+
+#define JOURNAL_BUCKETS 4096
+
+/*
+ * Each line holds the input hash, output hash, output and key separated
+ * by tabs. Lines are written with a single write() on a descriptor
+ * opened with O_APPEND, a line cut by a crash is ignored when loading.
+ */
+
+struct entry_ {
+	char *key;
+	char *output;
+	uint64_t in_hash;
+	uint64_t out_hash;
+	struct entry_ *next;
+};
+
+/*
+ * Lines are counted as they are written. One fdatasync() covers every
+ * line written before it started, so threads adding lines while a sync
+ * runs wait for the next one instead of each syncing in turn.
+ */
+struct journal_ {
+	int fd;
+	struct entry_ *table[JOURNAL_BUCKETS];
+	unsigned long written;
+	unsigned long synced;
+	unsigned long failed;
+	int syncing;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static unsigned int bucket(const char *key)
+{
+	return hash_fnv1a(key, strlen(key), HASH_INIT) % JOURNAL_BUCKETS;
+}
+
+static struct entry_ *lookup(Journal *j, const char *key)
+{
+	struct entry_ *e;
+
+	for (e = j->table[bucket(key)]; e; e = e->next) {
+		if (strcmp(e->key, key) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+static void load(Journal *j, FILE *fp)
+{
+	char *line = NULL, *output, *key;
+	size_t alloc = 0;
+	ssize_t len;
+	uint64_t in_hash, out_hash;
+	struct entry_ *e;
+	int n;
+
+	while ((len = getline(&line, &alloc, fp)) > 0) {
+		if (line[len - 1] != '\n')
+			break;
+		line[len - 1] = '\0';
+		if (sscanf(line, "%" SCNx64 "\t%" SCNx64 "\t%n", &in_hash,
+		           &out_hash, &n) < 2)
+			continue;
+		output = line + n;
+		key = strchr(output, '\t');
+		if (key == NULL)
+			continue;
+		*key++ = '\0';
+
+		e = lookup(j, key);
+		if (e == NULL) {
+			e = calloc(1, sizeof(*e));
+			if (e == NULL || (e->key = strdup(key)) == NULL) {
+				free(e);
+				continue;
+			}
+			e->next = j->table[bucket(key)];
+			j->table[bucket(key)] = e;
+		}
+		free(e->output);
+		e->output = strdup(output);
+		e->in_hash = in_hash;
+		e->out_hash = out_hash;
+	}
+	free(line);
+}
+
+Journal *journal_open(const char *path, int resume)
+{
+	Journal *j;
+	FILE *fp;
+
+	j = calloc(1, sizeof(*j));
+	if (j == NULL)
+		return NULL;
+
+	if (resume && (fp = fopen(path, "r")) != NULL) {
+		load(j, fp);
+		fclose(fp);
+	}
+
+	j->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC |
+	             (resume ? 0 : O_TRUNC), 0644);
+	if (j->fd < 0) {
+		fprintf(stderr, "could not open file %s: %s\n", path,
+		        strerror(errno));
+		journal_close(j);
+		return NULL;
+	}
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+
+	return j;
+}
+
+int journal_done(Journal *j, const char *key, uint64_t in_hash,
+                 const char *output, long long *out_size,
+                 uint64_t *out_hash)
+{
+	struct entry_ *e;
+
+	/* Entries are only added by journal_add for new outputs */
+	e = lookup(j, key);
+	if (e == NULL || e->in_hash != in_hash || e->output == NULL ||
+	    strcmp(e->output, output) != 0)
+		return 0;
+
+	*out_hash = HASH_INIT;
+	if (hash_file(output, out_hash, out_size) != 0 ||
+	    *out_hash != e->out_hash)
+		return 0;
+
+	return 1;
+}
+
+int journal_add(Journal *j, const char *key, uint64_t in_hash,
+                const char *output, uint64_t out_hash)
+{
+	unsigned long n, upto;
+	char *line;
+	int len, sync_ret, ret = 0;
+
+	line = malloc(strlen(key) + strlen(output) + 40);
+	if (line == NULL)
+		return -1;
+	len = sprintf(line, "%016" PRIx64 "\t%016" PRIx64 "\t%s\t%s\n",
+	              in_hash, out_hash, output, key);
+
+	pthread_mutex_lock(&j->lock);
+	if (write(j->fd, line, (size_t) len) != len) {
+		pthread_mutex_unlock(&j->lock);
+		free(line);
+		return -1;
+	}
+	n = ++j->written;
+
+	/* The line counts as done once a sync started after it succeeds */
+	while (j->synced < n && j->failed < n) {
+		if (j->syncing) {
+			pthread_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+		j->syncing = 1;
+		upto = j->written;
+		pthread_mutex_unlock(&j->lock);
+		sync_ret = fdatasync(j->fd);
+		pthread_mutex_lock(&j->lock);
+		j->syncing = 0;
+		if (sync_ret == 0)
+			j->synced = upto;
+		else
+			j->failed = upto;
+		pthread_cond_broadcast(&j->cond);
+	}
+	if (j->synced < n)
+		ret = -1;
+	pthread_mutex_unlock(&j->lock);
+	free(line);
+
+	return ret;
+}
+
+void journal_close(Journal *j)
+{
+	struct entry_ *e;
+	int i;
+
+	if (j->fd >= 0) {
+		close(j->fd);
+		pthread_mutex_destroy(&j->lock);
+		pthread_cond_destroy(&j->cond);
+	}
+	for (i = 0; i < JOURNAL_BUCKETS; i++) {
+		while ((e = j->table[i]) != NULL) {
+			j->table[i] = e->next;
+			free(e->key);
+			free(e->output);
+			free(e);
+		}
+	}
+	free(j);
+}
+
+int journal_sync_file(const char *path)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = fdatasync(fd);
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_JOURNAL_H
+#define DRG_JOURNAL_H
+
+#include <stdint.h>
+
+/*
+ * Append only record of the completed jobs of a batch run. A line is
+ * added once the output of a job is complete and renamed into place,
+ * so after a crash the journal lists only finished outputs.
+ */
+typedef struct journal_ Journal;
+
+/*
+ * Opens the journal in path. With resume the entries already in it are
+ * loaded, otherwise it is emptied.
+ */
+Journal *journal_open(const char *path, int resume);
+
+/*
+ * Checks if the job key was completed from an input with hash in_hash
+ * and its output still has the recorded contents, the size and hash of
+ * the output are returned in out_size and out_hash.
+ *
+ * returns   1 if the job is done, 0 otherwise
+ */
+int journal_done(Journal *j, const char *key, uint64_t in_hash,
+                 const char *output, long long *out_size,
+                 uint64_t *out_hash);
+
+/*
+ * Records a completed job, can be called from several threads. Returns
+ * once the line is on disk, threads adding lines at the same time share
+ * one disk flush.
+ *
+ * returns   0 on success, -1 on error
+ */
+int journal_add(Journal *j, const char *key, uint64_t in_hash,
+                const char *output, uint64_t out_hash);
+
+void journal_close(Journal *j);
+
+/*
+ * Flushes a file to disk, so it can be renamed into place safely.
+ */
+int journal_sync_file(const char *path);
+
+#endif /* DRG_JOURNAL_H */
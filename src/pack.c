@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pack.h"
+#include "hash.h"
+
+#define PACK_MAGIC "DRGPACK1"
+#define PACK_VERSION 1
+
+/*
+ * Header: magic, version (32 bits), number of files (32 bits), offset
+ * of the index and size of the pack, padded to PACK_ALIGN.
+ *
+ * Index entry: key, reserved (0), then offset and length of each blob.
+ */
+#define HEADER_SIZE PACK_ALIGN
+#define ENTRY_SIZE (16 + 16 * PACK_BLOBS)
+
+struct entry_ {
+	uint64_t key;
+	char *name;
+	uint64_t offset[PACK_BLOBS];
+	uint64_t len[PACK_BLOBS];
+};
+
+struct pack_writer_ {
+	int fd;
+	char *path;
+	char *tmp;
+	uint64_t end;
+	struct entry_ *entries;
+	int count;
+	int alloc;
+	int error;
+	pthread_mutex_t lock;
+};
+
+struct pack_ {
+	const unsigned char *map;
+	size_t size;
+	const unsigned char *index;
+	int count;
+};
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static uint64_t align(uint64_t offset)
+{
+	return (offset + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+}
+
+uint64_t pack_key(const char *header, const char *title)
+{
+	uint64_t h;
+
+	h = hash_fnv1a(header, strlen(header) + 1, HASH_INIT);
+
+	return hash_fnv1a(title, strlen(title), h);
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+PackWriter *pack_writer_new(const char *path)
+{
+	PackWriter *w;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+
+	w->path = strdup(path);
+	w->tmp = malloc(strlen(path) + 8);
+	if (w->path == NULL || w->tmp == NULL) {
+		free(w->path);
+		free(w->tmp);
+		free(w);
+		return NULL;
+	}
+	sprintf(w->tmp, "%s.XXXXXX", path);
+
+	w->fd = mkstemp(w->tmp);
+	if (w->fd < 0) {
+		fprintf(stderr, "could not create file %s: %s\n", w->tmp,
+		        strerror(errno));
+		free(w->path);
+		free(w->tmp);
+		free(w);
+		return NULL;
+	}
+	fchmod(w->fd, 0644);
+
+	w->end = HEADER_SIZE;
+	pthread_mutex_init(&w->lock, NULL);
+
+	return w;
+}
+
+/*
+ * The space for the blobs of an item is reserved under the lock, the
+ * blobs are then written without it.
+ */
+int pack_writer_add(PackWriter *w, const struct pack_item *item)
+{
+	static const char nul = '\0';
+	struct entry_ e;
+	uint64_t offset;
+	int i;
+
+	memset(&e, 0, sizeof(e));
+	e.key = pack_key(item->data[PACK_HEADER], item->data[PACK_TITLE]);
+	e.name = strndup(item->data[PACK_NAME], item->len[PACK_NAME]);
+	if (e.name == NULL)
+		return -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->count == w->alloc) {
+		struct entry_ *new;
+		int alloc = w->alloc ? 2 * w->alloc : 256;
+
+		new = realloc(w->entries, alloc * sizeof(*new));
+		if (new == NULL) {
+			pthread_mutex_unlock(&w->lock);
+			free(e.name);
+			return -1;
+		}
+		w->entries = new;
+		w->alloc = alloc;
+	}
+	offset = w->end;
+	for (i = 0; i < PACK_BLOBS; i++) {
+		e.offset[i] = offset = align(offset);
+		e.len[i] = item->len[i];
+		offset += item->len[i] + 1;
+	}
+	w->end = offset;
+	w->entries[w->count++] = e;
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < PACK_BLOBS; i++) {
+		if (pwrite_all(w->fd, item->data[i], e.len[i], e.offset[i]) != 0 ||
+		    pwrite_all(w->fd, &nul, 1, e.offset[i] + e.len[i]) != 0) {
+			pthread_mutex_lock(&w->lock);
+			w->error = errno;
+			pthread_mutex_unlock(&w->lock);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct entry_ *ea = a, *eb = b;
+
+	if (ea->key != eb->key)
+		return ea->key < eb->key ? -1 : 1;
+
+	return strcmp(ea->name, eb->name);
+}
+
+static int write_index(PackWriter *w)
+{
+	unsigned char header[HEADER_SIZE];
+	unsigned char *index, *p;
+	uint64_t offset;
+	int i, j, ret;
+
+	qsort(w->entries, w->count, sizeof(*w->entries), compare_entries);
+
+	index = malloc((size_t) w->count * ENTRY_SIZE + 1);
+	if (index == NULL)
+		return -1;
+	for (i = 0, p = index; i < w->count; i++, p += ENTRY_SIZE) {
+		put64(p, w->entries[i].key);
+		put64(p + 8, 0);
+		for (j = 0; j < PACK_BLOBS; j++) {
+			put64(p + 16 + 16 * j, w->entries[i].offset[j]);
+			put64(p + 24 + 16 * j, w->entries[i].len[j]);
+		}
+	}
+
+	offset = align(w->end);
+	memset(header, 0, sizeof(header));
+	memcpy(header, PACK_MAGIC, 8);
+	put32(header + 8, PACK_VERSION);
+	put32(header + 12, w->count);
+	put64(header + 16, offset);
+	put64(header + 24, offset + (uint64_t) w->count * ENTRY_SIZE);
+
+	ret = pwrite_all(w->fd, index, (size_t) w->count * ENTRY_SIZE, offset);
+	if (ret == 0)
+		ret = ftruncate(w->fd, offset + (uint64_t) w->count * ENTRY_SIZE);
+	if (ret == 0)
+		ret = pwrite_all(w->fd, header, sizeof(header), 0);
+	free(index);
+
+	return ret;
+}
+
+int pack_writer_close(PackWriter *w, int error)
+{
+	int i, ret = -1;
+
+	if (!error && !w->error) {
+		if (write_index(w) != 0 || fdatasync(w->fd) != 0)
+			fprintf(stderr, "could not write file %s: %s\n",
+			        w->tmp, strerror(errno));
+		else
+			ret = 0;
+	} else if (w->error) {
+		fprintf(stderr, "could not write file %s: %s\n", w->tmp,
+		        strerror(w->error));
+	}
+
+	if (close(w->fd) != 0)
+		ret = -1;
+	if (ret == 0 && rename(w->tmp, w->path) != 0) {
+		fprintf(stderr, "could not rename %s: %s\n", w->tmp,
+		        strerror(errno));
+		ret = -1;
+	}
+	if (ret != 0)
+		unlink(w->tmp);
+
+	for (i = 0; i < w->count; i++)
+		free(w->entries[i].name);
+	free(w->entries);
+	pthread_mutex_destroy(&w->lock);
+	free(w->path);
+	free(w->tmp);
+	free(w);
+
+	return ret;
+}
+
+/*
+ * Only the index is checked at open, it must be sorted for pack_find().
+ * The blobs are checked by pack_view() when they are used, so opening
+ * a pack does not touch a page of every blob.
+ */
+static int check_pack(const Pack *p)
+{
+	const unsigned char *e;
+	int i;
+
+	for (i = 1; i < p->count; i++) {
+		e = p->index + (size_t) i * ENTRY_SIZE;
+		if (get64(e) < get64(e - ENTRY_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
+Pack *pack_open(const char *path)
+{
+	struct stat st;
+	Pack *p;
+	void *map;
+	uint64_t offset;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "could not open file %s: %s\n", path,
+		        strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE) {
+		fprintf(stderr, "%s is not a pack\n", path);
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "could not map file %s: %s\n", path,
+		        strerror(errno));
+		return NULL;
+	}
+
+	p = malloc(sizeof(*p));
+	if (p == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	p->map = map;
+	p->size = st.st_size;
+	p->count = get32(p->map + 12);
+	offset = get64(p->map + 16);
+	p->index = p->map + offset;
+
+	if (memcmp(p->map, PACK_MAGIC, 8) != 0 ||
+	    get32(p->map + 8) != PACK_VERSION ||
+	    get64(p->map + 24) != p->size || offset > p->size ||
+	    (p->size - offset) / ENTRY_SIZE < (uint64_t) p->count ||
+	    check_pack(p) != 0) {
+		fprintf(stderr, "%s is not a valid pack\n", path);
+		pack_close(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void pack_close(Pack *p)
+{
+	munmap((void *) p->map, p->size);
+	free(p);
+}
+
+int pack_count(const Pack *p)
+{
+	return p->count;
+}
+
+uint64_t pack_entry_key(const Pack *p, int entry)
+{
+	return get64(p->index + (size_t) entry * ENTRY_SIZE);
+}
+
+const void *pack_view(const Pack *p, int entry, int blob, size_t *len)
+{
+	const unsigned char *e = p->index + (size_t) entry * ENTRY_SIZE;
+	uint64_t offset, size;
+
+	/* The blob must lie within the pack and be followed by its NUL */
+	offset = get64(e + 16 + 16 * blob);
+	size = get64(e + 24 + 16 * blob);
+	if (offset < HEADER_SIZE || offset >= p->size ||
+	    size >= p->size - offset || p->map[offset + size] != '\0')
+		return NULL;
+
+	if (len)
+		*len = size;
+
+	return p->map + offset;
+}
+
+int pack_find(const Pack *p, const char *header, const char *title)
+{
+	uint64_t key = pack_key(header, title);
+	const char *h, *t;
+	int low = 0, high = p->count, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (pack_entry_key(p, mid) < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	/* Entries with the same key are told apart by their strings */
+	for (; low < p->count && pack_entry_key(p, low) == key; low++) {
+		h = pack_view(p, low, PACK_HEADER, NULL);
+		t = pack_view(p, low, PACK_TITLE, NULL);
+		if (h && t && strcmp(h, header) == 0 && strcmp(t, title) == 0)
+			return low;
+	}
+
+	return -1;
+}
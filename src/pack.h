@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_PACK_H
+#define DRG_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A pack holds many converted drg files in a single file meant to be
+ * mapped in memory. It starts with a header, followed by the blobs of
+ * every file, each aligned to PACK_ALIGN bytes and followed by a NUL
+ * so text blobs can be used as strings, and ends with an index of the
+ * files sorted by key. Integers are stored little endian.
+ *
+ * The key of a file is pack_key() of its decoded header and title.
+ */
+
+#define PACK_ALIGN 64
+
+enum pack_blobs {
+    PACK_NAME = 0,
+    PACK_HEADER,
+    PACK_TITLE,
+    PACK_DESCRIPTION,
+    PACK_SBG,
+    PACK_IMAGE,
+    PACK_BLOBS
+};
+
+/*
+ * A file added to a pack, the blobs are copied by pack_writer_add().
+ */
+struct pack_item {
+	const void *data[PACK_BLOBS];
+	size_t len[PACK_BLOBS];
+};
+
+typedef struct pack_writer_ PackWriter;
+typedef struct pack_ Pack;
+
+uint64_t pack_key(const char *header, const char *title);
+
+/*
+ * Creates a pack in path, it is written to a temporary file renamed
+ * into place by pack_writer_close().
+ */
+PackWriter *pack_writer_new(const char *path);
+
+/*
+ * Adds a file to the pack, can be called from several threads.
+ *
+ * returns   0 on success, -1 on error
+ */
+int pack_writer_add(PackWriter *w, const struct pack_item *item);
+
+/*
+ * Writes the index and the header and renames the pack into place,
+ * with error set the pack is discarded.
+ *
+ * returns   0 on success, -1 on error
+ */
+int pack_writer_close(PackWriter *w, int error);
+
+/*
+ * Maps the pack in path, the blobs returned by pack_view() point into
+ * the mapping and are valid until pack_close().
+ */
+Pack *pack_open(const char *path);
+
+void pack_close(Pack *p);
+
+int pack_count(const Pack *p);
+
+/*
+ * Finds the file with the given header and title.
+ *
+ * returns   the position of the file in the index, -1 if not found
+ */
+int pack_find(const Pack *p, const char *header, const char *title);
+
+uint64_t pack_entry_key(const Pack *p, int entry);
+
+/*
+ * Returns a blob of the entry at position entry of the index, its
+ * length is stored in len if not NULL. Blobs are checked as they are
+ * viewed, NULL is returned if the blob is not within the pack.
+ */
+const void *pack_view(const Pack *p, int entry, int blob, size_t *len);
+
+#endif /* DRG_PACK_H */
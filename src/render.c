@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "render.h"
+
+#define MAX_VOICES 16
+#define PINK_ROWS 16
+#define DAY (24 * 3600.0)
+
+enum voice_types {
+	VOICE_OFF = 0,
+	VOICE_TONE,
+	VOICE_PINK,
+	VOICE_WHITE
+};
+
+struct voice_ {
+	int type;
+	double carrier;
+	double beat;
+	double amp;
+};
+
+struct toneset_ {
+	char *name;
+	struct voice_ voice[MAX_VOICES];
+};
+
+/*
+ * A voice slot during a period, frequencies and amplitudes change
+ * linearly from the start (a) to the end (b) of the period.
+ */
+struct slot_ {
+	double fa[2];
+	double fb[2];
+	double ta;
+	double tb;
+};
+
+struct entry_ {
+	double time;
+	int set;
+	int slide;
+	long long start;
+	long long end;
+
+	/* Tone slots, with their phase in cycles at the start */
+	struct slot_ slot[MAX_VOICES];
+	double phase[MAX_VOICES][2];
+	int tones[MAX_VOICES];
+	int tone_count;
+	double pink[2];
+	double white[2];
+};
+
+struct render_ {
+	struct toneset_ *sets;
+	int set_count;
+	struct entry_ *entries;
+	int entry_count;
+	int rate;
+	long long frames;
+	int quiet;
+	char error[128];
+};
+
+static const struct toneset_ silence;
+
+static int parse_hms(const char *str, double *seconds)
+{
+	int h, m, s = 0, n = 0;
+
+	if (sscanf(str, "%d:%d%n:%d%n", &h, &m, &n, &s, &n) < 2 ||
+	    str[n] != '\0' || h < 0 || m < 0 || m > 59 || s < 0 || s > 59)
+		return -1;
+
+	*seconds = h * 3600.0 + m * 60.0 + s;
+
+	return 0;
+}
+
+int render_parse_time(const char *str, double *seconds)
+{
+	char *end;
+
+	if (strchr(str, ':'))
+		return parse_hms(str, seconds);
+
+	*seconds = strtod(str, &end);
+	if (end == str || *end != '\0' || *seconds < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Parses a voice of a tone set, returns -1 if the voice is not
+ * understood.
+ */
+static int parse_voice(const char *spec, struct voice_ *v)
+{
+	char *end;
+
+	memset(v, 0, sizeof(*v));
+	if (strncmp(spec, "pink/", 5) == 0) {
+		v->type = VOICE_PINK;
+		spec += 5;
+	} else if (strncmp(spec, "white/", 6) == 0) {
+		v->type = VOICE_WHITE;
+		spec += 6;
+	} else {
+		v->type = VOICE_TONE;
+		v->carrier = strtod(spec, &end);
+		if (end == spec || v->carrier < 0)
+			return -1;
+		spec = end;
+		if (*spec == '+' || *spec == '-') {
+			v->beat = strtod(spec, &end);
+			if (end == spec)
+				return -1;
+			spec = end;
+		}
+		if (*spec++ != '/')
+			return -1;
+	}
+
+	v->amp = strtod(spec, &end);
+	if (end == spec || *end != '\0' || v->amp < 0)
+		return -1;
+	v->amp /= 100;
+
+	return 0;
+}
+
+/*
+ * Stores the first error found parsing the script, line 0 for errors
+ * not tied to a line.
+ */
+static void parse_error(Render *r, int line, const char *format, ...)
+{
+	va_list ap;
+	int n = 0;
+
+	if (r->error[0])
+		return;
+	if (line)
+		n = snprintf(r->error, sizeof(r->error), "sbagen line %d: ",
+		             line);
+	va_start(ap, format);
+	vsnprintf(r->error + n, sizeof(r->error) - n, format, ap);
+	va_end(ap);
+}
+
+static int find_set(const Render *r, const char *name)
+{
+	int i;
+
+	for (i = 0; i < r->set_count; i++) {
+		if (strcmp(r->sets[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static int parse_toneset(Render *r, char **tokens, int count, int line)
+{
+	struct toneset_ *set, *new;
+	int i, n = 0;
+
+	tokens[0][strlen(tokens[0]) - 1] = '\0';
+	if (find_set(r, tokens[0]) >= 0) {
+		parse_error(r, line, "tone set %s defined twice", tokens[0]);
+		return -1;
+	}
+
+	new = realloc(r->sets, (r->set_count + 1) * sizeof(*new));
+	if (new == NULL) {
+		parse_error(r, 0, "out of memory");
+		return -1;
+	}
+	r->sets = new;
+	set = &r->sets[r->set_count];
+	memset(set, 0, sizeof(*set));
+	set->name = strdup(tokens[0]);
+	if (set->name == NULL) {
+		parse_error(r, 0, "out of memory");
+		return -1;
+	}
+	r->set_count++;
+
+	for (i = 1; i < count; i++) {
+		if (strcmp(tokens[i], "-") == 0) {
+			n++;
+		} else if (strcmp(tokens[i], "{") == 0) {
+			parse_error(r, line, "block definitions are not "
+			            "supported");
+			return -1;
+		} else if (n >= MAX_VOICES) {
+			parse_error(r, line, "more than %d voices", MAX_VOICES);
+			return -1;
+		} else if (parse_voice(tokens[i], &set->voice[n]) != 0) {
+			if (!r->quiet)
+				fprintf(stderr, "sbagen line %d: skipping voice "
+				        "%s\n", line, tokens[i]);
+			memset(&set->voice[n], 0, sizeof(set->voice[n]));
+		} else {
+			n++;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_entry(Render *r, char **tokens, int count, int line,
+                       double *base)
+{
+	struct entry_ *new, *e;
+	const char *t = tokens[0];
+	double time;
+	int i, set;
+
+	if (count < 2) {
+		parse_error(r, line, "missing tone set");
+		return -1;
+	}
+
+	if (strncmp(t, "NOW", 3) == 0) {
+		time = 0;
+		t += 3;
+		if (*t == '+' && parse_hms(t + 1, &time) != 0)
+			t = "";
+		else if (*t == '+' || *t == '\0')
+			t = NULL;
+	} else if (*t == '+') {
+		if (parse_hms(t + 1, &time) == 0)
+			t = NULL;
+	} else if (parse_hms(t, &time) == 0) {
+		/* Clock times are relative to the first one */
+		if (*base < 0)
+			*base = time - (r->entry_count ?
+			        r->entries[r->entry_count - 1].time : 0);
+		time -= *base;
+		while (r->entry_count &&
+		       time < r->entries[r->entry_count - 1].time)
+			time += DAY;
+		t = NULL;
+	}
+	if (t != NULL) {
+		parse_error(r, line, "invalid time %s", tokens[0]);
+		return -1;
+	}
+	if (r->entry_count && time < r->entries[r->entry_count - 1].time) {
+		parse_error(r, line, "time %s goes back", tokens[0]);
+		return -1;
+	}
+
+	set = find_set(r, tokens[1]);
+	if (set < 0 && strcmp(tokens[1], "off") != 0) {
+		parse_error(r, line, "unknown tone set %s", tokens[1]);
+		return -1;
+	}
+
+	new = realloc(r->entries, (r->entry_count + 1) * sizeof(*new));
+	if (new == NULL) {
+		parse_error(r, 0, "out of memory");
+		return -1;
+	}
+	r->entries = new;
+	e = &r->entries[r->entry_count++];
+	memset(e, 0, sizeof(*e));
+	e->time = time;
+	e->set = set;
+	e->slide = 0;
+	for (i = 2; i < count; i++) {
+		if (strcmp(tokens[i], "->") == 0)
+			e->slide = 1;
+	}
+
+	return 0;
+}
+
+static int parse_script(Render *r, const char *script)
+{
+	char *copy, *line, *next, *p, *save;
+	char *tokens[MAX_VOICES + 8];
+	double base = -1;
+	int count, n = 0, ret = 0;
+
+	copy = strdup(script);
+	if (copy == NULL) {
+		parse_error(r, 0, "out of memory");
+		return -1;
+	}
+
+	for (line = copy; ret == 0 && line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		n++;
+
+		if ((p = strchr(line, '#')))
+			*p = '\0';
+		count = 0;
+		for (p = strtok_r(line, " \t\r", &save); p;
+		     p = strtok_r(NULL, " \t\r", &save)) {
+			if (count == MAX_VOICES + 8) {
+				parse_error(r, n, "line too long");
+				ret = -1;
+				break;
+			}
+			tokens[count++] = p;
+		}
+
+		if (ret != 0 || count == 0 || tokens[0][0] == '-')
+			continue;
+		if (tokens[0][strlen(tokens[0]) - 1] == ':')
+			ret = parse_toneset(r, tokens, count, n);
+		else
+			ret = parse_entry(r, tokens, count, n, &base);
+	}
+	free(copy);
+
+	return ret;
+}
+
+static const struct toneset_ *entry_set(const Render *r, int entry)
+{
+	int set = r->entries[entry].set;
+
+	return set < 0 ? &silence : &r->sets[set];
+}
+
+static void add_noise(struct entry_ *e, const struct voice_ *v, double a,
+                      double b)
+{
+	if (v->type == VOICE_PINK) {
+		e->pink[0] += a;
+		e->pink[1] += b;
+	} else if (v->type == VOICE_WHITE) {
+		e->white[0] += a;
+		e->white[1] += b;
+	}
+}
+
+static void set_tone(struct slot_ *s, const struct voice_ *v, double ta,
+                     double tb)
+{
+	s->fa[0] = s->fb[0] = v->carrier + v->beat / 2;
+	s->fa[1] = s->fb[1] = v->carrier - v->beat / 2;
+	s->ta = ta;
+	s->tb = tb;
+}
+
+/*
+ * Works out the voices of each period and the phase of the tones at its
+ * start, so any part of the audio can be rendered without rendering
+ * what comes before. A voice sliding to a voice of the same kind moves
+ * its frequency and amplitude, otherwise it fades out while the next
+ * one fades in.
+ */
+static void plan_periods(Render *r)
+{
+	const struct toneset_ *from, *to;
+	const struct voice_ *a, *b;
+	double phase[MAX_VOICES][2], n, d;
+	struct entry_ *e;
+	struct slot_ *s;
+	int i, j, ch;
+
+	memset(phase, 0, sizeof(phase));
+	for (i = 0; i < r->entry_count; i++) {
+		e = &r->entries[i];
+		/* The first entry starts at the beginning */
+		e->start = i ? (long long) (e->time * r->rate + 0.5) : 0;
+		if (e->start > r->frames)
+			e->start = r->frames;
+	}
+
+	for (i = 0; i < r->entry_count; i++) {
+		e = &r->entries[i];
+		e->end = i + 1 < r->entry_count ? r->entries[i + 1].start :
+		         r->frames;
+		from = entry_set(r, i);
+		to = from;
+		if (e->slide && i + 1 < r->entry_count)
+			to = entry_set(r, i + 1);
+
+		for (j = 0; j < MAX_VOICES; j++) {
+			a = &from->voice[j];
+			b = &to->voice[j];
+			s = &e->slot[j];
+			if (a == b) {
+				add_noise(e, a, a->amp, a->amp);
+			} else {
+				add_noise(e, a, a->amp, 0);
+				add_noise(e, b, 0, b->amp);
+			}
+
+			if (a->type == VOICE_TONE && b->type == VOICE_TONE) {
+				set_tone(s, a, a->amp, b->amp);
+				s->fb[0] = b->carrier + b->beat / 2;
+				s->fb[1] = b->carrier - b->beat / 2;
+			} else if (a->type == VOICE_TONE) {
+				set_tone(s, a, a->amp, b == a ? a->amp : 0);
+			} else if (b->type == VOICE_TONE) {
+				set_tone(s, b, 0, b->amp);
+			} else {
+				continue;
+			}
+			e->tones[e->tone_count++] = j;
+		}
+
+		/*
+		 * The frequency at sample k of a period of n samples is
+		 * fa + (fb - fa) k / n, the phase advances by the sum of the
+		 * frequencies of the samples before.
+		 */
+		memcpy(e->phase, phase, sizeof(phase));
+		n = e->end - e->start;
+		for (j = 0; j < e->tone_count; j++) {
+			s = &e->slot[e->tones[j]];
+			for (ch = 0; ch < 2; ch++) {
+				d = n > 0 ? (s->fb[ch] - s->fa[ch]) * (n - 1) / 2 : 0;
+				phase[e->tones[j]][ch] += (s->fa[ch] * n + d) / r->rate;
+				phase[e->tones[j]][ch] -= floor(phase[e->tones[j]][ch]);
+			}
+		}
+	}
+}
+
+static Render *parse(const char *script, int quiet)
+{
+	Render *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->quiet = quiet;
+
+	if (parse_script(r, script) == 0 && r->entry_count == 0)
+		parse_error(r, 0, "the sbagen data has no schedule");
+
+	return r;
+}
+
+int render_check(const char *script, char *error, size_t size)
+{
+	Render *r;
+	int ret = 0;
+
+	r = parse(script, 1);
+	if (r == NULL) {
+		snprintf(error, size, "out of memory");
+		return -1;
+	}
+	if (r->error[0]) {
+		snprintf(error, size, "%s", r->error);
+		ret = -1;
+	}
+	render_free(r);
+
+	return ret;
+}
+
+Render *render_new(const char *script, int rate, double length)
+{
+	Render *r;
+
+	r = parse(script, 0);
+	if (r == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	if (r->error[0]) {
+		fprintf(stderr, "%s\n", r->error);
+		render_free(r);
+		return NULL;
+	}
+	r->rate = rate;
+
+	if (length <= 0)
+		length = r->entries[r->entry_count - 1].time;
+	if (length <= 0) {
+		fprintf(stderr, "the schedule has no end, a length is "
+		        "needed\n");
+		render_free(r);
+		return NULL;
+	}
+	r->frames = (long long) (length * rate + 0.5);
+	plan_periods(r);
+
+	return r;
+}
+
+void render_free(Render *r)
+{
+	int i;
+
+	for (i = 0; i < r->set_count; i++)
+		free(r->sets[i].name);
+	free(r->sets);
+	free(r->entries);
+	free(r);
+}
+
+long long render_frames(const Render *r)
+{
+	return r->frames;
+}
+
+/* Uniform random number in [-1, 1) for a counter */
+static double noise(uint64_t n)
+{
+	n += 0x9e3779b97f4a7c15ULL;
+	n = (n ^ (n >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	n = (n ^ (n >> 27)) * 0x94d049bb133111ebULL;
+	n ^= n >> 31;
+
+	return (double) (n >> 11) / (1ULL << 52) - 1;
+}
+
+/*
+ * Pink noise by the Voss-McCartney algorithm, row k changes every
+ * 2^(k+1) samples, at samples where n has k trailing zeros. The value
+ * of a row depends only on its counter so noise can be rendered from
+ * any sample.
+ */
+static double pink_row(int k, long long n)
+{
+	return noise((((uint64_t) n + (1ULL << k)) >> (k + 1)) * 32 + k);
+}
+
+static short to_sample(double v)
+{
+	v = floor(v * 32767 + 0.5);
+	if (v > 32767)
+		return 32767;
+	if (v < -32768)
+		return -32768;
+
+	return v;
+}
+
+void render_range(const Render *r, long long start, int frames, short *buf)
+{
+	const struct entry_ *e;
+	const struct slot_ *s;
+	double row[PINK_ROWS], pink = 0, x, k, c, amp, out[2], len;
+	long long n;
+	int low = 0, high = r->entry_count - 1, mid, i, j, ch, z;
+
+	/* Last period starting at or before start */
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (r->entries[mid].start <= start)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	for (j = 0; j < PINK_ROWS; j++) {
+		row[j] = pink_row(j, start);
+		pink += row[j];
+	}
+
+	for (i = 0; i < frames; i++) {
+		n = start + i;
+		while (low + 1 < r->entry_count && r->entries[low + 1].start <= n)
+			low++;
+		e = &r->entries[low];
+
+		if (i > 0 && (z = __builtin_ctzll(n)) < PINK_ROWS) {
+			pink -= row[z];
+			row[z] = pink_row(z, n);
+			pink += row[z];
+		}
+
+		k = n - e->start;
+		len = e->end - e->start;
+		x = len > 0 ? k / len : 0;
+		out[0] = out[1] = 0;
+		for (j = 0; j < e->tone_count; j++) {
+			s = &e->slot[e->tones[j]];
+			amp = s->ta + (s->tb - s->ta) * x;
+			for (ch = 0; ch < 2; ch++) {
+				c = e->phase[e->tones[j]][ch] + (s->fa[ch] * k +
+				    (len > 0 ? (s->fb[ch] - s->fa[ch]) / len : 0) *
+				    k * (k - 1) / 2) / r->rate;
+				out[ch] += amp * sin(2 * M_PI * (c - floor(c)));
+			}
+		}
+
+		amp = (e->pink[0] + (e->pink[1] - e->pink[0]) * x) *
+		      (pink + noise((uint64_t) n * 32 + 16)) / 6 +
+		      (e->white[0] + (e->white[1] - e->white[0]) * x) *
+		      noise((uint64_t) n * 32 + 17);
+		buf[2 * i] = to_sample(out[0] + amp);
+		buf[2 * i + 1] = to_sample(out[1] + amp);
+	}
+}
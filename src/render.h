@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_RENDER_H
+#define DRG_RENDER_H
+
+#include <stddef.h>
+
+/*
+ * Renders the sbagen data of a drg file to 16 bit stereo samples.
+ *
+ * Only the common part of the sbagen syntax is understood: tone sets
+ * made of binaural tones (carrier+beat/amp, carrier-beat/amp,
+ * carrier/amp), pink and white noise, and a schedule of NOW, +HH:MM:SS
+ * and HH:MM:SS entries where -> slides to the next tone set. Other
+ * voices are skipped with a warning.
+ */
+typedef struct render_ Render;
+
+/*
+ * Parses script, the schedule is rendered until its last entry or for
+ * length seconds if length is not 0.
+ *
+ * returns   NULL if the script could not be parsed, the reason is
+ *           printed
+ */
+Render *render_new(const char *script, int rate, double length);
+
+void render_free(Render *r);
+
+/*
+ * Checks that script can be parsed, without rendering it. The reason of
+ * a failure is stored in error.
+ *
+ * returns   0 if the script is valid, -1 otherwise
+ */
+int render_check(const char *script, char *error, size_t size);
+
+/*
+ * Returns the number of frames (pairs of samples) rendered.
+ */
+long long render_frames(const Render *r);
+
+/*
+ * Renders frames starting at frame start into buf, left and right
+ * samples interleaved. Every frame depends only on its position, so
+ * parts of the audio can be rendered in any order by several threads
+ * and joined without clicks.
+ */
+void render_range(const Render *r, long long start, int frames, short *buf);
+
+/*
+ * Parses a time given as HH:MM, HH:MM:SS or a number of seconds.
+ *
+ * returns   0 on success, -1 if the time is not valid
+ */
+int render_parse_time(const char *str, double *seconds);
+
+#endif /* DRG_RENDER_H */
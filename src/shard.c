@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shard.h"
+#include "hash.h"
+
+struct manifest_ {
+	char *path;
+	char **lines;
+	int count;
+	int alloc;
+	pthread_mutex_t lock;
+};
+
+int shard_parse(const char *spec, int *k, int *n)
+{
+	char c;
+
+	if (sscanf(spec, "%d/%d%c", k, n, &c) != 2)
+		return -1;
+	if (*n < 1 || *k < 1 || *k > *n)
+		return -1;
+
+	return 0;
+}
+
+static int compare_items(const void *a, const void *b)
+{
+	const struct shard_item *x = a;
+	const struct shard_item *y = b;
+	uint64_t hx, hy;
+
+	if (x->size != y->size)
+		return x->size > y->size ? -1 : 1;
+
+	hx = hash_fnv1a(x->key, strlen(x->key), HASH_INIT);
+	hy = hash_fnv1a(y->key, strlen(y->key), HASH_INIT);
+	if (hx != hy)
+		return hx < hy ? -1 : 1;
+
+	return strcmp(x->key, y->key);
+}
+
+/* Final mix of splitmix64, spreads the bits of the key hash */
+static uint64_t mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* An item in the order shards are assigned, by hash of its key */
+struct order_ {
+	uint64_t hash;
+	const char *key;
+	long long size;
+	int index;
+};
+
+static int compare_order(const void *a, const void *b)
+{
+	const struct order_ *x = a;
+	const struct order_ *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+
+	return strcmp(x->key, y->key);
+}
+
+/*
+ * Rendezvous hashing with bounded loads: the item goes to the shard
+ * scoring highest for its key among those where it fits under cap, or
+ * to the least loaded shard if it fits nowhere.
+ */
+static int item_shard(const struct order_ *item, long long *load, int n,
+                      long long cap)
+{
+	uint64_t score, best_score = 0;
+	int j, best = -1, least = 0;
+
+	for (j = 0; j < n; j++) {
+		if (load[j] < load[least])
+			least = j;
+		if (load[j] + item->size > cap)
+			continue;
+		score = mix(item->hash +
+		            (uint64_t) (j + 1) * 0x9e3779b97f4a7c15ULL);
+		if (best < 0 || score > best_score) {
+			best_score = score;
+			best = j;
+		}
+	}
+	if (best < 0)
+		best = least;
+	load[best] += item->size;
+
+	return best;
+}
+
+int shard_select(struct shard_item *items, int count, int k, int n)
+{
+	struct shard_item tmp;
+	struct order_ *order;
+	long long *load, total = 0;
+	int *shard, i, t, selected = 0;
+
+	if (n <= 1)
+		return count;
+
+	order = malloc(count * sizeof(*order) + 1);
+	shard = malloc(count * sizeof(*shard) + 1);
+	load = calloc(n, sizeof(*load));
+	if (order == NULL || shard == NULL || load == NULL) {
+		free(order);
+		free(shard);
+		free(load);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		order[i].key = items[i].key;
+		order[i].hash = hash_fnv1a(items[i].key, strlen(items[i].key),
+		                           HASH_INIT);
+		order[i].size = items[i].size > 0 ? items[i].size : 0;
+		order[i].index = i;
+		total += order[i].size;
+	}
+
+	/*
+	 * Every node visits the items in the same order, so they agree on
+	 * the loads. A shard takes at most an eighth more than its part.
+	 */
+	qsort(order, count, sizeof(*order), compare_order);
+	for (i = 0; i < count; i++)
+		shard[order[i].index] = item_shard(&order[i], load, n,
+		                                   total / n + total / n / 8);
+
+	for (i = 0; i < count; i++) {
+		if (shard[i] == k - 1) {
+			tmp = items[selected];
+			items[selected] = items[i];
+			items[i] = tmp;
+			t = shard[selected];
+			shard[selected] = shard[i];
+			shard[i] = t;
+			selected++;
+		}
+	}
+
+	/* Largest first, only the order the jobs are run in */
+	qsort(items, selected, sizeof(*items), compare_items);
+
+	free(order);
+	free(shard);
+	free(load);
+
+	return selected;
+}
+
+Manifest *manifest_new(const char *dir, int k, int n)
+{
+	Manifest *m;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return NULL;
+
+	m->path = malloc(strlen(dir) + 40);
+	if (m->path == NULL) {
+		free(m);
+		return NULL;
+	}
+	sprintf(m->path, "%s/manifest-%d-of-%d", dir, k, n);
+	pthread_mutex_init(&m->lock, NULL);
+
+	return m;
+}
+
+int manifest_add(Manifest *m, const char *input, const char *output,
+                 long long size, uint64_t hash)
+{
+	char str[17];
+	char *line, **lines;
+
+	hash_to_string(hash, str);
+
+	line = malloc(strlen(input) + strlen(output) + 48);
+	if (line == NULL)
+		return -1;
+	sprintf(line, "%s\t%s\t%lld\t%s\n", output, input, size, str);
+
+	pthread_mutex_lock(&m->lock);
+	if (m->count == m->alloc) {
+		lines = realloc(m->lines, (m->alloc * 2 + 64) * sizeof(*lines));
+		if (lines == NULL) {
+			pthread_mutex_unlock(&m->lock);
+			free(line);
+			return -1;
+		}
+		m->lines = lines;
+		m->alloc = m->alloc * 2 + 64;
+	}
+	m->lines[m->count++] = line;
+	pthread_mutex_unlock(&m->lock);
+
+	return 0;
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int manifest_close(Manifest *m)
+{
+	FILE *fp;
+	char *tmp;
+	int i, ret = -1;
+
+	qsort(m->lines, m->count, sizeof(*m->lines), compare_lines);
+
+	tmp = malloc(strlen(m->path) + 5);
+	if (tmp == NULL)
+		goto out;
+	sprintf(tmp, "%s.tmp", m->path);
+
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "could not open file %s: %s\n", tmp,
+		        strerror(errno));
+		goto out;
+	}
+	for (i = 0; i < m->count; i++)
+		fputs(m->lines[i], fp);
+	if (fclose(fp) != 0 || rename(tmp, m->path) != 0) {
+		fprintf(stderr, "could not write file %s: %s\n", m->path,
+		        strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < m->count; i++)
+		free(m->lines[i]);
+	free(m->lines);
+	free(m->path);
+	free(tmp);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+
+	return ret;
+}
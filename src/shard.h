@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_SHARD_H
+#define DRG_SHARD_H
+
+#include <stdint.h>
+
+/*
+ * An input of a batch run, key identifies the input (the same on every
+ * node) and size is the cost of converting it.
+ */
+struct shard_item {
+	const char *key;
+	long long size;
+	void *data;
+};
+
+typedef struct manifest_ Manifest;
+
+/*
+ * Parses a "K/N" shard specification, 1 <= K <= N.
+ *
+ * returns   0 on success, -1 if the specification is not valid
+ */
+int shard_parse(const char *spec, int *k, int *n);
+
+/*
+ * Moves the items of shard k of n to the start of items, largest
+ * first, and returns their number, or -1 if out of memory. The items
+ * are visited by hash of their key and each goes to the shard its key
+ * prefers among those its size fits in, the shards taking at most an
+ * eighth more than an even part of the total size. Every node given
+ * the same list computes the same shards without talking to the
+ * others, and adding or removing a file moves few other files.
+ */
+int shard_select(struct shard_item *items, int count, int k, int n);
+
+/*
+ * Creates the manifest of shard k of n in dir. k = n = 1 is used for a
+ * run that is not sharded.
+ */
+Manifest *manifest_new(const char *dir, int k, int n);
+
+/*
+ * Records an output with its size and checksum (see hash_file). Can be
+ * called from several threads.
+ */
+int manifest_add(Manifest *m, const char *input, const char *output,
+                 long long size, uint64_t hash);
+
+/*
+ * Writes the manifest sorted by output, so the manifests of all the
+ * shards can be merged with sort -m, and frees it.
+ *
+ * returns   0 on success, -1 on error
+ */
+int manifest_close(Manifest *m);
+
+#endif /* DRG_SHARD_H */
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define CHUNK_EVENTS 1024
+#define STRING_BLOCK 65536
+
+struct event_ {
+	const char *name;
+	const char *file;
+	long long size;
+	long long ts;
+	char phase;
+};
+
+struct chunk_ {
+	struct event_ ev[CHUNK_EVENTS];
+	int used;
+	struct chunk_ *next;
+};
+
+/*
+ * File names are copied into blocks of the thread, so the callers may
+ * free them and recording an event does not allocate each time.
+ */
+struct strings_ {
+	size_t used;
+	size_t size;
+	struct strings_ *next;
+	char data[];
+};
+
+/*
+ * Events of a thread, the chunks are only touched by their thread
+ * until trace_close().
+ */
+struct thread_ {
+	int tid;
+	struct chunk_ *first;
+	struct chunk_ *last;
+	struct strings_ *strings;
+	long long dropped;
+	struct thread_ *next;
+};
+
+static int enabled;
+static char *trace_path;
+static struct timespec start;
+static struct thread_ *threads;
+static int thread_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct thread_ *local;
+
+static long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec - start.tv_sec) * 1000000000LL +
+	       (ts.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * The buffer of a thread is registered on its first event, threads are
+ * numbered in that order.
+ */
+static struct thread_ *thread_buffer(void)
+{
+	struct thread_ *t;
+
+	if (local)
+		return local;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	t->tid = ++thread_count;
+	t->next = threads;
+	threads = t;
+	pthread_mutex_unlock(&lock);
+
+	return local = t;
+}
+
+static const char *copy_string(struct thread_ *t, const char *s)
+{
+	struct strings_ *b = t->strings;
+	size_t len = strlen(s) + 1;
+	size_t size = len > STRING_BLOCK ? len : STRING_BLOCK;
+	char *copy;
+
+	if (b == NULL || b->size - b->used < len) {
+		b = malloc(sizeof(*b) + size);
+		if (b == NULL)
+			return NULL;
+		b->used = 0;
+		b->size = size;
+		b->next = t->strings;
+		t->strings = b;
+	}
+	copy = b->data + b->used;
+	memcpy(copy, s, len);
+	b->used += len;
+
+	return copy;
+}
+
+static void record(char phase, const char *name, const char *file,
+                   long long size)
+{
+	struct thread_ *t;
+	struct chunk_ *c;
+	struct event_ *e;
+
+	t = thread_buffer();
+	if (t == NULL)
+		return;
+
+	c = t->last;
+	if (c == NULL || c->used == CHUNK_EVENTS) {
+		c = malloc(sizeof(*c));
+		if (c == NULL) {
+			t->dropped++;
+			return;
+		}
+		c->used = 0;
+		c->next = NULL;
+		if (t->last)
+			t->last->next = c;
+		else
+			t->first = c;
+		t->last = c;
+	}
+
+	e = &c->ev[c->used++];
+	e->phase = phase;
+	e->name = name;
+	e->file = file ? copy_string(t, file) : NULL;
+	e->size = size;
+	e->ts = now();
+}
+
+int trace_open(const char *path)
+{
+	trace_path = strdup(path);
+	if (trace_path == NULL)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	enabled = 1;
+
+	return 0;
+}
+
+int trace_enabled(void)
+{
+	return enabled;
+}
+
+void trace_begin(const char *name, const char *file, long long size)
+{
+	if (enabled)
+		record('B', name, file, size);
+}
+
+void trace_end(const char *name, long long size)
+{
+	if (enabled)
+		record('E', name, NULL, size);
+}
+
+static void write_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void write_event(FILE *fp, int pid, int tid, const struct event_ *e)
+{
+	fprintf(fp, "{\"name\":");
+	write_string(fp, e->name);
+	fprintf(fp, ",\"ph\":\"%c\",\"ts\":%lld.%03lld,\"pid\":%d,\"tid\":%d",
+	        e->phase, e->ts / 1000, e->ts % 1000, pid, tid);
+	if (e->file || e->size >= 0) {
+		fprintf(fp, ",\"args\":{");
+		if (e->file) {
+			fprintf(fp, "\"file\":");
+			write_string(fp, e->file);
+		}
+		if (e->size >= 0)
+			fprintf(fp, "%s\"size\":%lld", e->file ? "," : "",
+			        e->size);
+		fputc('}', fp);
+	}
+	fputc('}', fp);
+}
+
+int trace_close(void)
+{
+	struct thread_ *t, *next_t;
+	struct chunk_ *c, *next_c;
+	struct strings_ *b;
+	FILE *fp;
+	int pid = getpid();
+	int i, first = 1, ret = 0;
+
+	if (!enabled)
+		return 0;
+	enabled = 0;
+
+	fp = fopen(trace_path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "could not open trace file %s: %s\n",
+		        trace_path, strerror(errno));
+		ret = -1;
+	} else {
+		fprintf(fp, "{\"traceEvents\":[\n");
+	}
+
+	for (t = threads; t; t = next_t) {
+		if (fp) {
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+			        "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":"
+			        "\"thread %d\"}}", first ? "" : ",\n", pid,
+			        t->tid, t->tid);
+			first = 0;
+		}
+		for (c = t->first; c; c = next_c) {
+			for (i = 0; i < c->used; i++) {
+				if (fp) {
+					fprintf(fp, ",\n");
+					write_event(fp, pid, t->tid, &c->ev[i]);
+				}
+			}
+			next_c = c->next;
+			free(c);
+		}
+		if (t->dropped)
+			fprintf(stderr, "trace: %lld events of thread %d lost\n",
+			        t->dropped, t->tid);
+		while ((b = t->strings) != NULL) {
+			t->strings = b->next;
+			free(b);
+		}
+		next_t = t->next;
+		free(t);
+	}
+	threads = NULL;
+	local = NULL;
+
+	if (fp) {
+		fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+		if (fclose(fp) != 0) {
+			fprintf(stderr, "could not write trace file %s: %s\n",
+			        trace_path, strerror(errno));
+			ret = -1;
+		}
+	}
+	free(trace_path);
+	trace_path = NULL;
+
+	return ret;
+}
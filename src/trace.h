@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_TRACE_H
+#define DRG_TRACE_H
+
+/*
+ * Timeline of a run in Chrome trace-event format. Events are recorded
+ * in a buffer of the calling thread, without locking, and written to
+ * the file by trace_close(). While tracing is not enabled recording an
+ * event only checks a flag.
+ *
+ * The names of the events must be static strings, they are not copied.
+ * File names are copied once into a block of the thread.
+ */
+
+/*
+ * Enables tracing, the events are written to path on trace_close().
+ *
+ * returns   0 on success, -1 on error
+ */
+int trace_open(const char *path);
+
+int trace_enabled(void);
+
+/*
+ * Starts an event in the calling thread, file and size (-1 for none)
+ * are stored as arguments of the event.
+ */
+void trace_begin(const char *name, const char *file, long long size);
+
+/*
+ * Ends the last event started by the calling thread.
+ */
+void trace_end(const char *name, long long size);
+
+/*
+ * Writes the recorded events and disables tracing, must be called once
+ * the threads recording events are finished.
+ *
+ * returns   0 on success, -1 on error
+ */
+int trace_close(void);
+
+#endif /* DRG_TRACE_H */
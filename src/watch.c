@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+#include "workpool.h"
+#include "hash.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* Time without events on a file before it is considered complete */
+#define DEBOUNCE_MS 50
+#define STATE_BUCKETS 4096
+
+struct entry_ {
+	char *name;
+	long long size;
+	long long mtime;
+	int busy;
+	struct entry_ *next;
+};
+
+struct pending_ {
+	char *name;
+	long long deadline;
+	int closed;
+	struct pending_ *next;
+};
+
+struct watch_ {
+	const char *in_dir;
+	const char *state_file;
+	FILE *state_fp;
+	long lines;
+	long converted;
+	struct entry_ *table[STATE_BUCKETS];
+	struct pending_ *pending;
+	watch_fn convert;
+	void *arg;
+	WorkPool *pool;
+	pthread_mutex_t lock;
+};
+
+struct task_ {
+	struct watch_ *w;
+	struct entry_ *entry;
+	char *path;
+	long long size;
+	long long mtime;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int is_drg(const char *name)
+{
+	size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".drg") == 0;
+}
+
+static struct entry_ *lookup(struct watch_ *w, const char *name)
+{
+	unsigned int b;
+	struct entry_ *e;
+
+	b = hash_fnv1a(name, strlen(name), HASH_INIT) % STATE_BUCKETS;
+	for (e = w->table[b]; e; e = e->next) {
+		if (strcmp(e->name, name) == 0)
+			return e;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL || (e->name = strdup(name)) == NULL) {
+		free(e);
+		return NULL;
+	}
+	e->size = -1;
+	e->next = w->table[b];
+	w->table[b] = e;
+
+	return e;
+}
+
+static void load_state(struct watch_ *w, FILE *fp)
+{
+	char line[4096];
+	long long size, mtime;
+	struct entry_ *e;
+	int n;
+
+	while (fgets(line, sizeof(line), fp)) {
+		n = (int) strlen(line);
+		/* A line cut by a crash is ignored */
+		if (n == 0 || line[n - 1] != '\n')
+			continue;
+		line[n - 1] = '\0';
+		if (sscanf(line, "%lld %lld %n", &size, &mtime, &n) < 2)
+			continue;
+		e = lookup(w, line + n);
+		if (e) {
+			if (e->size < 0)
+				w->converted++;
+			e->size = size;
+			e->mtime = mtime;
+		}
+		w->lines++;
+	}
+}
+
+/*
+ * The state file is a log with a line per conversion, it is rewritten
+ * with one line per converted file at start and when the log has grown
+ * to several times that. Called with the lock held or before the
+ * workers start.
+ */
+static int compact_state(struct watch_ *w)
+{
+	struct entry_ *e;
+	char *tmp;
+	FILE *fp;
+	int fd, i;
+
+	tmp = malloc(strlen(w->state_file) + 8);
+	if (tmp == NULL)
+		return -1;
+	sprintf(tmp, "%s.XXXXXX", w->state_file);
+	fd = mkstemp(tmp);
+	fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (fp == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	for (i = 0; i < STATE_BUCKETS; i++) {
+		for (e = w->table[i]; e; e = e->next) {
+			if (e->size >= 0)
+				fprintf(fp, "%lld %lld %s\n", e->size,
+				        e->mtime, e->name);
+		}
+	}
+
+	/* The new file is kept open to append the next conversions */
+	if (fflush(fp) != 0 || fdatasync(fd) != 0 ||
+	    rename(tmp, w->state_file) != 0) {
+		fclose(fp);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	if (w->state_fp)
+		fclose(w->state_fp);
+	w->state_fp = fp;
+	w->lines = w->converted;
+
+	return 0;
+}
+
+static void run_task(void *data, void *arg)
+{
+	struct task_ *t = data;
+	struct watch_ *w = t->w;
+	int ret;
+
+	(void) arg;
+	ret = w->convert(t->path, t->entry->name, w->arg);
+
+	pthread_mutex_lock(&w->lock);
+	if (ret == 0) {
+		if (t->entry->size < 0)
+			w->converted++;
+		t->entry->size = t->size;
+		t->entry->mtime = t->mtime;
+		fprintf(w->state_fp, "%lld %lld %s\n", t->size, t->mtime,
+		        t->entry->name);
+		fflush(w->state_fp);
+		if (++w->lines > 2 * w->converted + 1024)
+			compact_state(w);
+	}
+	t->entry->busy = 0;
+	pthread_mutex_unlock(&w->lock);
+
+	free(t->path);
+	free(t);
+}
+
+/*
+ * Queues the conversion of name unless it was already converted,
+ * returns 1 when the file is being converted and should be retried.
+ */
+static int dispatch(struct watch_ *w, const char *name)
+{
+	struct task_ *t;
+	struct entry_ *e;
+	struct stat st;
+	int busy = 0;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return 0;
+	t->path = malloc(strlen(w->in_dir) + strlen(name) + 2);
+	if (t->path == NULL) {
+		free(t);
+		return 0;
+	}
+	sprintf(t->path, "%s/%s", w->in_dir, name);
+
+	if (stat(t->path, &st) != 0 || !S_ISREG(st.st_mode))
+		goto skip;
+	t->size = (long long) st.st_size;
+	t->mtime = (long long) st.st_mtim.tv_sec * 1000000000LL +
+	           st.st_mtim.tv_nsec;
+
+	pthread_mutex_lock(&w->lock);
+	e = lookup(w, name);
+	if (e == NULL || e->busy ||
+	    (e->size == t->size && e->mtime == t->mtime)) {
+		busy = e ? e->busy : 0;
+		pthread_mutex_unlock(&w->lock);
+		goto skip;
+	}
+	e->busy = 1;
+	pthread_mutex_unlock(&w->lock);
+
+	t->w = w;
+	t->entry = e;
+	if (workpool_add(w->pool, t) == 0)
+		return 0;
+
+	pthread_mutex_lock(&w->lock);
+	e->busy = 0;
+	pthread_mutex_unlock(&w->lock);
+
+skip:
+	free(t->path);
+	free(t);
+	return busy;
+}
+
+static void touch_pending(struct watch_ *w, const char *name, int closed,
+                          long long deadline)
+{
+	struct pending_ *p;
+
+	for (p = w->pending; p; p = p->next) {
+		if (strcmp(p->name, name) == 0)
+			break;
+	}
+	if (p == NULL) {
+		p = calloc(1, sizeof(*p));
+		if (p == NULL || (p->name = strdup(name)) == NULL) {
+			free(p);
+			return;
+		}
+		p->next = w->pending;
+		w->pending = p;
+	}
+	p->closed = closed;
+	p->deadline = deadline;
+}
+
+/*
+ * Dispatches the pending files that have been quiet long enough and
+ * returns the time to wait for the next one (-1 if none).
+ */
+static int flush_pending(struct watch_ *w)
+{
+	struct pending_ **pp, *p;
+	long long now = now_ms();
+	long long next = -1;
+
+	pp = &w->pending;
+	while ((p = *pp) != NULL) {
+		if (p->closed && p->deadline <= now) {
+			if (dispatch(w, p->name)) {
+				p->deadline = now + DEBOUNCE_MS;
+			} else {
+				*pp = p->next;
+				free(p->name);
+				free(p);
+				continue;
+			}
+		}
+		if (p->closed && (next < 0 || p->deadline - now < next))
+			next = p->deadline > now ? p->deadline - now : 0;
+		pp = &p->next;
+	}
+
+	return (int) next;
+}
+
+/*
+ * Queues every drg file of the directory, those already converted are
+ * skipped by dispatch().
+ */
+static void scan_dir(struct watch_ *w)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(w->in_dir);
+	if (dir == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		if (is_drg(de->d_name))
+			touch_pending(w, de->d_name, 1, 0);
+	}
+	closedir(dir);
+}
+
+static void read_events(struct watch_ *w, int fd)
+{
+	char buf[16384]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *ptr;
+
+	len = read(fd, buf, sizeof(buf));
+	if (len <= 0)
+		return;
+
+	for (ptr = buf; ptr < buf + len;
+	     ptr += sizeof(struct inotify_event) + ev->len) {
+		ev = (const struct inotify_event *) ptr;
+		/* Events were lost, the directory is scanned again */
+		if (ev->mask & IN_Q_OVERFLOW) {
+			scan_dir(w);
+			continue;
+		}
+		if (ev->len == 0 || !is_drg(ev->name))
+			continue;
+		if (ev->mask & IN_MOVED_TO)
+			touch_pending(w, ev->name, 1, now_ms());
+		else if (ev->mask & IN_CLOSE_WRITE)
+			touch_pending(w, ev->name, 1, now_ms() + DEBOUNCE_MS);
+		else if (ev->mask & IN_MODIFY)
+			touch_pending(w, ev->name, 0, 0);
+	}
+}
+
+int watch_dir(const char *in_dir, const char *state_file, int jobs,
+              watch_fn convert, void *arg)
+{
+	struct watch_ w;
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct entry_ *e;
+	struct pending_ *p;
+	FILE *fp;
+	int fd, i, timeout, ret = -1;
+
+	memset(&w, 0, sizeof(w));
+	w.in_dir = in_dir;
+	w.state_file = state_file;
+	w.convert = convert;
+	w.arg = arg;
+	pthread_mutex_init(&w.lock, NULL);
+
+	fp = fopen(state_file, "r");
+	if (fp) {
+		load_state(&w, fp);
+		fclose(fp);
+	}
+	if (compact_state(&w) != 0) {
+		fprintf(stderr, "could not write file %s: %s\n", state_file,
+		        strerror(errno));
+		goto out;
+	}
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, in_dir, IN_CLOSE_WRITE |
+	                                IN_MOVED_TO | IN_MODIFY) < 0) {
+		fprintf(stderr, "could not watch %s: %s\n", in_dir,
+		        strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+
+	w.pool = workpool_new(jobs, run_task, NULL);
+	if (w.pool == NULL) {
+		fprintf(stderr, "could not start workers\n");
+		close(fd);
+		goto out;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Catch up with files written while we were not running */
+	scan_dir(&w);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		timeout = flush_pending(&w);
+		if (poll(&pfd, 1, timeout) > 0)
+			read_events(&w, fd);
+	}
+
+	workpool_free(w.pool);
+	close(fd);
+	ret = 0;
+
+out:
+	if (w.state_fp)
+		fclose(w.state_fp);
+	while ((p = w.pending) != NULL) {
+		w.pending = p->next;
+		free(p->name);
+		free(p);
+	}
+	for (i = 0; i < STATE_BUCKETS; i++) {
+		while ((e = w.table[i]) != NULL) {
+			w.table[i] = e->next;
+			free(e->name);
+			free(e);
+		}
+	}
+	pthread_mutex_destroy(&w.lock);
+
+	return ret;
+}
+
+#else /* HAVE_SYS_INOTIFY_H */
+
+int watch_dir(const char *in_dir, const char *state_file, int jobs,
+              watch_fn convert, void *arg)
+{
+	(void) in_dir;
+	(void) state_file;
+	(void) jobs;
+	(void) convert;
+	(void) arg;
+	fprintf(stderr, "watch mode is not supported on this system\n");
+	return -1;
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_WATCH_H
+#define DRG_WATCH_H
+
+/*
+ * Function called to convert a file found in the watched directory.
+ *
+ * in_path   path of the drg file
+ * name      name of the drg file (without directory)
+ * arg       the argument given to watch_dir
+ * returns   0 when the file was converted
+ */
+typedef int (*watch_fn)(const char *in_path, const char *name, void *arg);
+
+/*
+ * Watches in_dir and calls convert on a pool of jobs threads for every
+ * drg file written or moved into it. Files already converted are
+ * remembered in state_file so they are not converted again after a
+ * restart. Runs until SIGINT or SIGTERM is received.
+ *
+ * returns   0 on a clean exit, -1 on error
+ */
+int watch_dir(const char *in_dir, const char *state_file, int jobs,
+              watch_fn convert, void *arg);
+
+#endif /* DRG_WATCH_H */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+struct job_ {
+	void *data;
+	long long cost;
+	int skipped;
+	struct job_ *next;
+};
+
+struct workpool_ {
+	pthread_t *threads;
+	int nthreads;
+	workpool_fn fn;
+	void *arg;
+	struct job_ *head;
+	struct job_ *tail;
+	long long budget;
+	long long used;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* The job run by the calling worker, for workpool_set_cost() */
+static __thread WorkPool *current_pool;
+static __thread struct job_ *current_job;
+
+/*
+ * Takes the first queued job fitting in what is left of the budget, a
+ * job bigger than the budget runs when nothing else is running. Jobs
+ * may pass the first one only a few times so it is not starved.
+ */
+static struct job_ *take_job(WorkPool *pool)
+{
+	struct job_ *job, *prev = NULL;
+
+	for (job = pool->head; job; prev = job, job = job->next) {
+		if (pool->budget == 0 || pool->used == 0 ||
+		    pool->used + job->cost <= pool->budget)
+			break;
+		if (job == pool->head &&
+		    job->skipped >= 4 * pool->nthreads)
+			return NULL;
+	}
+	if (job == NULL)
+		return NULL;
+
+	if (job != pool->head)
+		pool->head->skipped++;
+	if (prev)
+		prev->next = job->next;
+	else
+		pool->head = job->next;
+	if (pool->tail == job)
+		pool->tail = prev;
+	pool->used += job->cost;
+
+	return job;
+}
+
+static void *worker(void *data)
+{
+	WorkPool *pool = data;
+	struct job_ *job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while ((job = take_job(pool)) == NULL &&
+		       (pool->head != NULL || !pool->done))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		if (job == NULL)
+			break;
+
+		current_pool = pool;
+		current_job = job;
+		pool->fn(job->data, pool->arg);
+		current_pool = NULL;
+		current_job = NULL;
+
+		if (job->cost) {
+			pthread_mutex_lock(&pool->lock);
+			pool->used -= job->cost;
+			pthread_cond_broadcast(&pool->cond);
+			pthread_mutex_unlock(&pool->lock);
+		}
+		free(job);
+	}
+
+	return NULL;
+}
+
+int workpool_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+WorkPool *workpool_new(int threads, workpool_fn fn, void *arg)
+{
+	WorkPool *pool;
+	int i;
+
+	if (threads < 1)
+		threads = workpool_cpus();
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = calloc(threads, sizeof(*pool->threads));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pool->fn = fn;
+	pool->arg = arg;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+			break;
+		pool->nthreads++;
+	}
+
+	if (pool->nthreads == 0) {
+		workpool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void workpool_set_cost(long long cost)
+{
+	WorkPool *pool = current_pool;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->budget) {
+		pool->used += cost - current_job->cost;
+		current_job->cost = cost;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void workpool_set_budget(WorkPool *pool, long long budget)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->budget = budget;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int workpool_add(WorkPool *pool, void *data)
+{
+	return workpool_add_cost(pool, data, 0);
+}
+
+int workpool_add_cost(WorkPool *pool, void *data, long long cost)
+{
+	struct job_ *job;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL)
+		return -1;
+	job->data = data;
+	job->cost = cost;
+	job->skipped = 0;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void workpool_free(WorkPool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->done = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2012  Manuel Argüelles <manuel.arguelles@gmail.com>
+ *
+ * This file is part of drg2sbg.
+ *
+ * Drg2sbg is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Drg2sbg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Drg2sbg.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRG_WORKPOOL_H
+#define DRG_WORKPOOL_H
+
+typedef struct workpool_ WorkPool;
+
+/*
+ * Function run by the workers for every job added to the pool.
+ *
+ * job       the job as given to workpool_add
+ * arg       the argument given to workpool_new
+ */
+typedef void (*workpool_fn)(void *job, void *arg);
+
+/*
+ * Creates a pool of threads running fn on the queued jobs.
+ *
+ * threads   number of worker threads, 0 to use one per online cpu
+ * fn        function to run on each job
+ * arg       extra argument passed to fn
+ * returns   the new pool or NULL on error
+ */
+WorkPool *workpool_new(int threads, workpool_fn fn, void *arg);
+
+/*
+ * Queues a job, it will be run by the first idle worker.
+ */
+int workpool_add(WorkPool *pool, void *job);
+
+/*
+ * Queues a job with a cost, the memory it is expected to use, checked
+ * against the budget of the pool.
+ */
+int workpool_add_cost(WorkPool *pool, void *job, long long cost);
+
+/*
+ * Replaces the cost of the job running on the calling thread once it
+ * is better known, jobs waiting for the budget may start if it is
+ * lower. Does nothing outside of a job or in a pool without a budget.
+ */
+void workpool_set_cost(long long cost);
+
+/*
+ * Limits the sum of the costs of the jobs running at once, 0 for no
+ * limit. Jobs are started in order while they fit, then the next ones
+ * that fit in what is left; a job costing more than the budget runs
+ * alone.
+ */
+void workpool_set_budget(WorkPool *pool, long long budget);
+
+/*
+ * Waits until every queued job is done and frees the pool.
+ */
+void workpool_free(WorkPool *pool);
+
+/*
+ * Returns the number of online cpus.
+ */
+int workpool_cpus(void);
+
+#endif /* DRG_WORKPOOL_H */